@@ -9,12 +9,32 @@
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <semaphore.h>
+#include <future>
+#include <memory>
+#include <unordered_map>
+#include <map>
+#include <deque>
 #include <algorithm>
 #include <curl/curl.h>
 #include <regex>
 #include <cctype>
+#include <cstring>
 #include <locale.h>
 #include <codecvt>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
 
 
 #define COLOR_BG 0
@@ -25,6 +45,79 @@
 #define COLOR_PROGRESS 5
 #define COLOR_INPUT 6
 
+#ifdef COOKIE_RT_DEBUG
+#include <dlfcn.h>
+#include <stdarg.h>
+
+enum RtViolationKind { RT_ALLOC, RT_LOCK, RT_SYSCALL, RT_VIOLATION_KINDS };
+
+static thread_local bool t_in_audio_callback = false;
+static std::atomic<unsigned> g_rt_violations[RT_VIOLATION_KINDS];
+static bool g_rt_trap = getenv("COOKIE_RT_TRAP") != nullptr;
+
+static void rt_violation(RtViolationKind kind) {
+    if (!t_in_audio_callback) return;
+    g_rt_violations[kind]++;
+    if (g_rt_trap) raise(SIGTRAP);
+}
+
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void __libc_free(void*);
+
+void* rt_malloc(size_t n) __asm__("malloc");
+void* rt_calloc(size_t n, size_t sz) __asm__("calloc");
+void* rt_realloc(void* p, size_t n) __asm__("realloc");
+void rt_free(void* p) __asm__("free");
+int rt_pthread_mutex_lock(pthread_mutex_t* m) __asm__("pthread_mutex_lock");
+int rt_open(const char* path, int flags, ...) __asm__("open");
+
+void* rt_malloc(size_t n) { rt_violation(RT_ALLOC); return __libc_malloc(n); }
+void* rt_calloc(size_t n, size_t sz) { rt_violation(RT_ALLOC); return __libc_calloc(n, sz); }
+void* rt_realloc(void* p, size_t n) { rt_violation(RT_ALLOC); return __libc_realloc(p, n); }
+void rt_free(void* p) { rt_violation(RT_ALLOC); __libc_free(p); }
+
+int rt_pthread_mutex_lock(pthread_mutex_t* m) {
+    rt_violation(RT_LOCK);
+    static int (*real)(pthread_mutex_t*) = (int (*)(pthread_mutex_t*))dlsym(RTLD_NEXT, "pthread_mutex_lock");
+    return real(m);
+}
+
+int rt_open(const char* path, int flags, ...) {
+    rt_violation(RT_SYSCALL);
+    static int (*real)(const char*, int, ...) = (int (*)(const char*, int, ...))dlsym(RTLD_NEXT, "open");
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return real(path, flags, mode);
+}
+}
+
+#define RT_SYSCALL_WRAPPER(ret, name, params, args) \
+    extern "C" ret rt_##name params __asm__(#name); \
+    extern "C" ret rt_##name params { \
+        rt_violation(RT_SYSCALL); \
+        static ret (*real) params = (ret (*) params)dlsym(RTLD_NEXT, #name); \
+        return real args; \
+    }
+
+RT_SYSCALL_WRAPPER(ssize_t, read, (int fd, void* buf, size_t n), (fd, buf, n))
+RT_SYSCALL_WRAPPER(ssize_t, write, (int fd, const void* buf, size_t n), (fd, buf, n))
+RT_SYSCALL_WRAPPER(ssize_t, pread64, (int fd, void* buf, size_t n, off_t off), (fd, buf, n, off))
+RT_SYSCALL_WRAPPER(off_t, lseek, (int fd, off_t off, int whence), (fd, off, whence))
+RT_SYSCALL_WRAPPER(int, close, (int fd), (fd))
+RT_SYSCALL_WRAPPER(int, poll, (struct pollfd* fds, nfds_t n, int timeout), (fds, n, timeout))
+RT_SYSCALL_WRAPPER(int, nanosleep, (const struct timespec* req, struct timespec* rem), (req, rem))
+RT_SYSCALL_WRAPPER(int, clock_nanosleep, (clockid_t c, int flags, const struct timespec* req, struct timespec* rem), (c, flags, req, rem))
+RT_SYSCALL_WRAPPER(int, sched_yield, (void), ())
+#endif
+
 std::wstring utf8_to_wstring(const std::string& str) {
     std::wstring ws(str.size(), L'\0');
     std::mbstowcs(&ws[0], str.c_str(), str.size());
@@ -66,21 +159,526 @@ bool is_music_file(const std::string &filename) {
     return ext == "mp3" || ext == "wav" || ext == "flac" || ext == "ogg" || ext == "m4a";
 }
 
-std::vector<std::string> get_local_music_files(const std::string &dirpath) {
-    std::vector<std::string> files;
+// One row of the library. Remote names are kept URL-encoded, as they go
+// back into request URLs; size and mtime are -1/0 when the listing has none.
+struct MusicEntry {
+    std::string name;
+    int64_t size = -1;
+    time_t mtime = 0;
+    bool dir = false;
+};
+
+// Reads one local directory. Subdirectories that readdir already identifies
+// go straight to entries; music files, and anything whose type the
+// filesystem leaves as DT_UNKNOWN or hides behind a symlink, are returned in
+// unresolved for stat_local_entries to look at.
+void list_local_directory(const std::string &dirpath, std::vector<MusicEntry> &entries, std::vector<std::string> &unresolved) {
     DIR* dir = opendir(dirpath.c_str());
-    if (!dir) return files;
+    if (!dir) return;
     struct dirent* entry;
     while ((entry = readdir(dir))) {
         std::string name = entry->d_name;
-        if (entry->d_type == DT_REG && is_music_file(name)) {
-            files.push_back(name);
+        if (name == "." || name == "..") continue;
+        if (entry->d_type == DT_DIR) {
+            MusicEntry sub;
+            sub.name = name;
+            sub.dir = true;
+            entries.push_back(sub);
+        } else if ((entry->d_type == DT_REG && is_music_file(name)) || entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            unresolved.push_back(name);
         }
     }
     closedir(dir);
-    return files;
 }
 
+// Type, size and mtime of one name relative to dirfd, following symlinks.
+// AT_STATX_DONT_SYNC lets NFS and CIFS answer from their attribute cache.
+static bool stat_local_entry(int dirfd, const char* name, MusicEntry &entry) {
+    struct stat st;
+#ifdef STATX_TYPE
+    struct statx sx;
+    if (statx(dirfd, name, AT_STATX_DONT_SYNC | AT_NO_AUTOMOUNT, STATX_TYPE | STATX_SIZE | STATX_MTIME, &sx) == 0) {
+        entry.dir = S_ISDIR(sx.stx_mode);
+        entry.size = (int64_t)sx.stx_size;
+        entry.mtime = sx.stx_mtime.tv_sec;
+        return entry.dir || S_ISREG(sx.stx_mode);
+    }
+    if (errno != ENOSYS) return false;
+#endif
+    if (fstatat(dirfd, name, &st, 0) != 0) return false;
+    entry.dir = S_ISDIR(st.st_mode);
+    entry.size = (int64_t)st.st_size;
+    entry.mtime = st.st_mtime;
+    return entry.dir || S_ISREG(st.st_mode);
+}
+
+// Stats names inside dirpath, keeping music files with their size and mtime
+// and any directories among them.
+void stat_local_entries(const std::string &dirpath, const std::vector<std::string> &names, std::vector<MusicEntry> &entries) {
+    int dirfd = open(dirpath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) return;
+    for (const std::string &name : names) {
+        MusicEntry entry;
+        if (!stat_local_entry(dirfd, name.c_str(), entry)) continue;
+        if (!entry.dir && !is_music_file(name)) continue;
+        if (entry.dir) {
+            entry.size = -1;
+            entry.mtime = 0;
+        }
+        entry.name = name;
+        entries.push_back(std::move(entry));
+    }
+    close(dirfd);
+}
+
+// The library keeps every name in one byte arena. Tracks and directories are
+// fixed-size records pointing into it: a track holds its base name and the
+// id of its directory, a directory its path relative to the root and its
+// parent's id. Sorting, rendering and playing read these records and build a
+// std::string only for the rows that are shown or played.
+static const uint32_t LIBRARY_NO_DIR = UINT32_MAX;
+
+struct NameRef {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct LibraryDir {
+    NameRef path;
+    uint32_t parent;
+    // Out of dir_index; its slot goes at the next compaction.
+    bool removed = false;
+};
+
+struct LibraryTrack {
+    NameRef name;
+    uint32_t dir;
+    int64_t size;
+    int64_t mtime;
+};
+
+struct Library {
+    std::vector<char> names;
+    std::vector<LibraryDir> dirs;
+    std::vector<LibraryTrack> tracks;
+    std::unordered_multimap<uint64_t, uint32_t> dir_index;
+    size_t garbage = 0;
+};
+
+static uint64_t name_hash(const char* s, size_t n) {
+    uint64_t hash = 1469598103934665603ull;
+    for (size_t i = 0; i < n; i++) hash = (hash ^ (unsigned char)s[i]) * 1099511628211ull;
+    return hash;
+}
+
+static NameRef library_intern(Library &lib, const char* s, size_t n) {
+    NameRef ref{(uint32_t)lib.names.size(), (uint32_t)n};
+    lib.names.insert(lib.names.end(), s, s + n);
+    return ref;
+}
+
+static const char* library_name(const Library &lib, NameRef ref) {
+    return lib.names.data() + ref.offset;
+}
+
+static uint32_t library_find_dir(const Library &lib, const char* path, size_t n) {
+    auto range = lib.dir_index.equal_range(name_hash(path, n));
+    for (auto it = range.first; it != range.second; ++it) {
+        NameRef ref = lib.dirs[it->second].path;
+        if (ref.length == n && memcmp(library_name(lib, ref), path, n) == 0) return it->second;
+    }
+    return LIBRARY_NO_DIR;
+}
+
+// Finds or adds the directory at path, adding its parents on the way.
+static uint32_t library_dir(Library &lib, const char* path, size_t n) {
+    uint32_t id = library_find_dir(lib, path, n);
+    if (id != LIBRARY_NO_DIR) return id;
+    const char* slash = n > 0 ? (const char*)memrchr(path, '/', n) : nullptr;
+    uint32_t parent = n == 0 ? LIBRARY_NO_DIR : library_dir(lib, path, slash ? slash - path : 0);
+    id = (uint32_t)lib.dirs.size();
+    lib.dirs.push_back({library_intern(lib, path, n), parent, false});
+    lib.dir_index.emplace(name_hash(path, n), id);
+    return id;
+}
+
+// A track's path relative to the root as two pieces, joined by an implied '/'.
+struct PathView {
+    const char* dir;
+    size_t dir_len;
+    const char* name;
+    size_t name_len;
+};
+
+static PathView track_view(const Library &lib, const LibraryTrack &t) {
+    NameRef dir = lib.dirs[t.dir].path;
+    return {library_name(lib, dir), dir.length, library_name(lib, t.name), t.name.length};
+}
+
+// Case-insensitive, like strcasecmp on the joined paths.
+static int path_compare(const PathView &a, const PathView &b) {
+    size_t a_len = a.dir_len + (a.dir_len ? 1 : 0) + a.name_len;
+    size_t b_len = b.dir_len + (b.dir_len ? 1 : 0) + b.name_len;
+    auto at = [](const PathView &v, size_t i) -> unsigned char {
+        if (i < v.dir_len) return (unsigned char)v.dir[i];
+        if (v.dir_len) {
+            if (i == v.dir_len) return '/';
+            i -= v.dir_len + 1;
+        }
+        return (unsigned char)v.name[i];
+    };
+    for (size_t i = 0; i < a_len && i < b_len; i++) {
+        int ca = tolower(at(a, i)), cb = tolower(at(b, i));
+        if (ca != cb) return ca - cb;
+    }
+    return a_len < b_len ? -1 : a_len > b_len ? 1 : 0;
+}
+
+std::string library_path(const Library &lib, size_t index) {
+    PathView v = track_view(lib, lib.tracks[index]);
+    std::string path;
+    path.reserve(v.dir_len + 1 + v.name_len);
+    path.append(v.dir, v.dir_len);
+    if (v.dir_len) path += '/';
+    path.append(v.name, v.name_len);
+    return path;
+}
+
+// Index of the track at path, or -1.
+int library_find(const Library &lib, const std::string &path) {
+    PathView key{"", 0, path.data(), path.size()};
+    auto less = [&](const LibraryTrack &t, const PathView &k) { return path_compare(track_view(lib, t), k) < 0; };
+    auto it = std::lower_bound(lib.tracks.begin(), lib.tracks.end(), key, less);
+    for (; it != lib.tracks.end() && path_compare(track_view(lib, *it), key) == 0; ++it) {
+        if (library_path(lib, it - lib.tracks.begin()) == path) return (int)(it - lib.tracks.begin());
+    }
+    return -1;
+}
+
+// Rewrites the arena with only the names still referenced, and renumbers
+// the directories that were not removed.
+static void library_compact(Library &lib) {
+    std::vector<char> names;
+    names.reserve(lib.names.size() - lib.garbage);
+    auto move_name = [&](NameRef &ref) {
+        uint32_t offset = (uint32_t)names.size();
+        names.insert(names.end(), lib.names.begin() + ref.offset, lib.names.begin() + ref.offset + ref.length);
+        ref.offset = offset;
+    };
+    std::vector<uint32_t> renumber(lib.dirs.size(), LIBRARY_NO_DIR);
+    std::vector<LibraryDir> dirs;
+    for (size_t d = 0; d < lib.dirs.size(); d++) {
+        if (lib.dirs[d].removed) continue;
+        renumber[d] = (uint32_t)dirs.size();
+        dirs.push_back(lib.dirs[d]);
+    }
+    lib.dir_index.clear();
+    for (uint32_t d = 0; d < dirs.size(); d++) {
+        if (dirs[d].parent != LIBRARY_NO_DIR) dirs[d].parent = renumber[dirs[d].parent];
+        move_name(dirs[d].path);
+        lib.dir_index.emplace(name_hash(names.data() + dirs[d].path.offset, dirs[d].path.length), d);
+    }
+    for (LibraryTrack &t : lib.tracks) {
+        t.dir = renumber[t.dir];
+        move_name(t.name);
+    }
+    lib.dirs.swap(dirs);
+    lib.names.swap(names);
+    lib.garbage = 0;
+}
+
+// Applies a batch from the scanner or crawler: removals first (a name ending
+// in '/' drops a subtree, an empty one everything), then additions, which
+// are sorted among themselves and merged into the sorted tracks.
+void library_apply(Library &lib, std::vector<MusicEntry> &added, const std::vector<std::string> &removed) {
+    if (!removed.empty()) {
+        std::vector<bool> dropped_dir(lib.dirs.size(), false);
+        std::unordered_multimap<uint32_t, std::string> dropped;
+        for (const std::string &name : removed) {
+            if (name.empty()) {
+                dropped_dir.assign(lib.dirs.size(), true);
+                continue;
+            }
+            if (name.back() != '/') {
+                size_t slash = name.find_last_of('/');
+                uint32_t dir = library_find_dir(lib, name.data(), slash == std::string::npos ? 0 : slash);
+                if (dir != LIBRARY_NO_DIR) dropped.emplace(dir, name.substr(slash == std::string::npos ? 0 : slash + 1));
+                continue;
+            }
+            for (size_t d = 0; d < lib.dirs.size(); d++) {
+                NameRef ref = lib.dirs[d].path;
+                if (!lib.dirs[d].removed && ref.length + 1 >= name.size() && memcmp(library_name(lib, ref), name.data(), name.size() - 1) == 0 &&
+                    (ref.length == name.size() - 1 || library_name(lib, ref)[name.size() - 1] == '/')) {
+                    dropped_dir[d] = true;
+                }
+            }
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < lib.tracks.size(); i++) {
+            const LibraryTrack &t = lib.tracks[i];
+            bool drop = dropped_dir[t.dir];
+            auto range = dropped.equal_range(t.dir);
+            for (auto it = range.first; !drop && it != range.second; ++it) {
+                drop = it->second.size() == t.name.length && memcmp(it->second.data(), library_name(lib, t.name), t.name.length) == 0;
+            }
+            if (drop) lib.garbage += lib.tracks[i].name.length;
+            else lib.tracks[kept++] = lib.tracks[i];
+        }
+        lib.tracks.resize(kept);
+        for (uint32_t d = 0; d < lib.dirs.size(); d++) {
+            LibraryDir &dir = lib.dirs[d];
+            if (!dropped_dir[d] || dir.removed) continue;
+            auto range = lib.dir_index.equal_range(name_hash(library_name(lib, dir.path), dir.path.length));
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == d) {
+                    lib.dir_index.erase(it);
+                    break;
+                }
+            }
+            dir.removed = true;
+            lib.garbage += dir.path.length;
+        }
+    }
+
+    size_t first_new = lib.tracks.size();
+    for (const MusicEntry &entry : added) {
+        size_t slash = entry.name.find_last_of('/');
+        size_t dir_len = slash == std::string::npos ? 0 : slash;
+        size_t base = slash == std::string::npos ? 0 : slash + 1;
+        LibraryTrack t;
+        t.dir = library_dir(lib, entry.name.data(), dir_len);
+        t.name = library_intern(lib, entry.name.data() + base, entry.name.size() - base);
+        t.size = entry.size;
+        t.mtime = entry.mtime;
+        lib.tracks.push_back(t);
+    }
+    auto less = [&](const LibraryTrack &a, const LibraryTrack &b) { return path_compare(track_view(lib, a), track_view(lib, b)) < 0; };
+    std::sort(lib.tracks.begin() + first_new, lib.tracks.end(), less);
+    std::inplace_merge(lib.tracks.begin(), lib.tracks.begin() + first_new, lib.tracks.end(), less);
+
+    if (lib.garbage > (64u << 10) && lib.garbage > lib.names.size() / 2) library_compact(lib);
+}
+
+enum ThreadRole { ROLE_AUDIO, ROLE_DECODER, ROLE_NETWORK, ROLE_ANALYSIS, ROLE_UI, ROLE_COUNT };
+
+static const char* THREAD_ROLE_NAMES[ROLE_COUNT] = {"audio", "decoder", "network", "analysis", "ui"};
+static const char* THREAD_ROLE_DEFAULTS[ROLE_COUNT] = {"fifo:70", "fifo:40", "nice:0", "idle", "nice:0"};
+
+struct ThreadRoleConfig {
+    std::string spec;
+    int policy = SCHED_OTHER;
+    int priority = 0;
+    int nice = 0;
+    bool has_cpus = false;
+    cpu_set_t cpus;
+};
+
+struct ThreadRoleStatus {
+    pid_t tid = 0;
+    std::string effective = "not started";
+    std::string affinity;
+};
+
+static ThreadRoleConfig g_role_config[ROLE_COUNT];
+static ThreadRoleStatus g_role_status[ROLE_COUNT];
+static std::mutex g_role_mx;
+
+bool parse_cpu_list(const std::string &list, cpu_set_t &set) {
+    CPU_ZERO(&set);
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        std::string item = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t dash = item.find('-');
+        try {
+            int lo = std::stoi(item.substr(0, dash));
+            int hi = dash == std::string::npos ? lo : std::stoi(item.substr(dash + 1));
+            for (int c = lo; c <= hi && c < CPU_SETSIZE; c++) CPU_SET(c, &set);
+        } catch (...) {
+            return false;
+        }
+        if (comma == std::string::npos) break;
+        pos = comma + 1;
+    }
+    return CPU_COUNT(&set) > 0;
+}
+
+std::string format_cpu_list(const cpu_set_t &set) {
+    std::string out;
+    int total = std::min<long>(CPU_SETSIZE, sysconf(_SC_NPROCESSORS_CONF));
+    for (int c = 0; c < total; c++) {
+        if (!CPU_ISSET(c, &set)) continue;
+        int end = c;
+        while (end + 1 < total && CPU_ISSET(end + 1, &set)) end++;
+        if (!out.empty()) out += ",";
+        out += std::to_string(c);
+        if (end > c) out += "-" + std::to_string(end);
+        c = end;
+    }
+    return out;
+}
+
+// Spec format: policy[:value][@cpulist], e.g. "fifo:70@2-3", "nice:-5", "idle".
+bool parse_thread_role(const std::string &spec, ThreadRoleConfig &cfg) {
+    cfg.spec = spec;
+    std::string policy = spec.substr(0, spec.find_first_of(":@"));
+    size_t colon = spec.find(':');
+    size_t at = spec.find('@');
+    int value = 0;
+    if (colon != std::string::npos) {
+        try {
+            value = std::stoi(spec.substr(colon + 1, at == std::string::npos ? std::string::npos : at - colon - 1));
+        } catch (...) {
+            return false;
+        }
+    }
+
+    if (policy == "fifo" || policy == "rr") {
+        cfg.policy = policy == "fifo" ? SCHED_FIFO : SCHED_RR;
+        cfg.priority = std::max(1, std::min(99, value));
+        cfg.nice = -std::min(20, cfg.priority / 6 + 1);
+    } else if (policy == "nice" || policy == "other") {
+        cfg.policy = SCHED_OTHER;
+        cfg.nice = std::max(-20, std::min(19, value));
+    } else if (policy == "batch") {
+        cfg.policy = SCHED_BATCH;
+        cfg.nice = std::max(-20, std::min(19, value));
+    } else if (policy == "idle") {
+        cfg.policy = SCHED_IDLE;
+    } else {
+        return false;
+    }
+
+    cfg.has_cpus = at != std::string::npos && parse_cpu_list(spec.substr(at + 1), cfg.cpus);
+    return true;
+}
+
+void load_thread_roles() {
+    for (int r = 0; r < ROLE_COUNT; r++) {
+        std::string var = "COOKIE_SCHED_" + std::string(THREAD_ROLE_NAMES[r]);
+        std::transform(var.begin(), var.end(), var.begin(), ::toupper);
+        const char* env = getenv(var.c_str());
+        if (!env || !parse_thread_role(env, g_role_config[r])) {
+            parse_thread_role(THREAD_ROLE_DEFAULTS[r], g_role_config[r]);
+        }
+    }
+}
+
+static bool try_realtime(pid_t tid, int policy, int priority) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_RTPRIO, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_RTPRIO, &rl);
+    }
+    if (getrlimit(RLIMIT_RTPRIO, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (rlim_t)priority > rl.rlim_cur) {
+        priority = (int)rl.rlim_cur;
+    }
+    if (priority < 1) return false;
+
+    sched_param sp{};
+    sp.sched_priority = priority;
+    return sched_setscheduler(tid, policy | SCHED_RESET_ON_FORK, &sp) == 0;
+}
+
+// Applies a role to the calling thread, or to tid for threads that must not
+// spend time on it themselves (the audio callback).
+void apply_thread_role(ThreadRole role, pid_t tid = 0) {
+    const ThreadRoleConfig &cfg = g_role_config[role];
+    if (tid == 0) tid = (pid_t)syscall(SYS_gettid);
+    std::string note;
+
+    bool applied = false;
+    if (cfg.policy == SCHED_FIFO || cfg.policy == SCHED_RR) {
+        applied = try_realtime(tid, cfg.policy, cfg.priority);
+        if (!applied) note = " (rt denied)";
+    } else if (cfg.policy == SCHED_IDLE || cfg.policy == SCHED_BATCH) {
+        sched_param sp{};
+        applied = sched_setscheduler(tid, cfg.policy, &sp) == 0 && cfg.policy == SCHED_IDLE;
+    }
+
+    if (!applied) {
+        struct rlimit rl;
+        int nice = cfg.nice;
+        if (setpriority(PRIO_PROCESS, tid, nice) != 0 && getrlimit(RLIMIT_NICE, &rl) == 0) {
+            // Settle for the lowest nice RLIMIT_NICE allows, but only if that
+            // is still an improvement: with the default limit of 0 it is 19.
+            int floor = 20 - (int)std::min<rlim_t>(rl.rlim_cur, 40);
+            errno = 0;
+            int current = getpriority(PRIO_PROCESS, tid);
+            if (errno == 0 && nice < floor && floor < current) setpriority(PRIO_PROCESS, tid, floor);
+        }
+    }
+
+    if (cfg.has_cpus) sched_setaffinity(tid, sizeof(cfg.cpus), &cfg.cpus);
+
+    int policy = sched_getscheduler(tid);
+    sched_param sp{};
+    sched_getparam(tid, &sp);
+    std::string effective;
+    switch (policy & ~SCHED_RESET_ON_FORK) {
+        case SCHED_FIFO: effective = "FIFO " + std::to_string(sp.sched_priority); break;
+        case SCHED_RR: effective = "RR " + std::to_string(sp.sched_priority); break;
+        case SCHED_IDLE: effective = "IDLE"; break;
+        case SCHED_BATCH: effective = "BATCH nice " + std::to_string(getpriority(PRIO_PROCESS, tid)); break;
+        default: effective = "OTHER nice " + std::to_string(getpriority(PRIO_PROCESS, tid)); break;
+    }
+
+    cpu_set_t actual;
+    CPU_ZERO(&actual);
+    sched_getaffinity(tid, sizeof(actual), &actual);
+
+    std::lock_guard<std::mutex> lock(g_role_mx);
+    g_role_status[role].tid = tid;
+    g_role_status[role].effective = effective + note;
+    g_role_status[role].affinity = format_cpu_list(actual);
+}
+
+// Bounded multi-producer queue (Vyukov); pop() must only be called from one thread.
+template <typename T, size_t N>
+struct MpscRing {
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+    Cell cells[N];
+    std::atomic<size_t> head{0};
+    size_t tail = 0;
+
+    MpscRing() {
+        for (size_t i = 0; i < N; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(T value) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells[pos % N];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T &out) {
+        Cell &cell = cells[tail % N];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(tail + 1) < 0) return false;
+        out = std::move(cell.value);
+        cell.seq.store(tail + N, std::memory_order_release);
+        tail++;
+        return true;
+    }
+};
+
 static size_t curl_write_memory_callback(void* contents, size_t size, size_t nmemb, void* userp) {
     size_t totalSize = size * nmemb;
     std::vector<char>* buffer = (std::vector<char>*)userp;
@@ -88,220 +686,3021 @@ static size_t curl_write_memory_callback(void* contents, size_t size, size_t nme
     return totalSize;
 }
 
-std::vector<std::string> get_remote_music_files(const std::string& url, const std::string& username, const std::string& password) {
-    std::vector<std::string> files;
-    CURL* curl = curl_easy_init();
-    if (!curl) return files;
+// Sizes a body from Content-Length on the first write, so the insert in
+// curl_write_memory_callback never has to grow it.
+static void reserve_body(CURL* easy, std::vector<char> &body) {
+    if (!body.empty()) return;
+    curl_off_t length = -1;
+    curl_easy_getinfo(easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    if (length > 0) body.reserve((size_t)length);
+}
+
+struct FetchCancel {
+    const std::atomic<uint64_t>* latest;
+    uint64_t generation;
+};
+
+enum NetRequestKind { NET_LISTING, NET_DOWNLOAD, NET_RANGE, NET_PREFETCH };
+
+enum NetPriority { PRIO_PLAYBACK, PRIO_NEXT_TRACK, PRIO_METADATA, PRIO_BULK, PRIO_COUNT };
+
+static const char* NET_PRIORITY_NAMES[PRIO_COUNT] = {"playback", "next-track", "metadata", "bulk"};
+static const int NET_MAX_PER_HOST = 4;
+// Background rates in bytes/s, applied only while a playback transfer is running.
+static const double NET_SHAPED_RATE[PRIO_COUNT] = {0, 1024 * 1024, 256 * 1024, 128 * 1024};
+static const double NET_BUCKET_BURST_SECONDS = 0.25;
+static const int NET_MAX_RETRIES = 8;
+static const auto NET_RETRY_BASE_DELAY = std::chrono::milliseconds(250);
+static const auto NET_RETRY_MAX_DELAY = std::chrono::seconds(8);
+static const long NET_STALL_SECONDS = 15;
+
+struct TokenBucket {
+    double rate = 0;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+    void refill() {
+        auto now = std::chrono::steady_clock::now();
+        double secs = std::chrono::duration<double>(now - last).count();
+        last = now;
+        tokens = std::min(rate * NET_BUCKET_BURST_SECONDS, tokens + rate * secs);
+    }
+};
+
+struct NetResult {
+    CURLcode code = CURLE_FAILED_INIT;
+    long status = 0;
+    curl_off_t content_length = -1;
+    curl_off_t resource_length = -1;
+    std::string etag;
+    std::string last_modified;
+    std::string content_type;
+    std::vector<char> body;
+
+    bool ok() const { return code == CURLE_OK; }
+};
+
+static const size_t REMOTE_WINDOW_BYTES = 16u << 20;
+static const size_t REMOTE_KEEP_BEHIND = 256u << 10;
+static const size_t REMOTE_RESUME_ROOM = 1u << 20;
+static const size_t NET_SEGMENT_BYTES = 1u << 20;
+// A stream's segments share its host's connection cap, so more would only queue.
+static const int NET_MAX_SEGMENTS = NET_MAX_PER_HOST;
+static const size_t STREAM_PAGE_BYTES = 64u << 10;
+
+struct StreamSegment {
+    uint64_t start;
+    uint64_t size;
+    uint64_t received;
+    uint64_t request;
+};
+
+// A window of a remote track around the read cursor, held in a circular buffer
+// of at most REMOTE_WINDOW_BYTES: byte x of the file lives at offset x % capacity
+// while start <= x < end. The network thread appends and pauses when the
+// window is full; bytes more than REMOTE_KEEP_BEHIND behind the reader are
+// given up to make room.
+//
+// The buffer is a table of STREAM_PAGE_BYTES pages. When Content-Length is
+// known every page is allocated up front; otherwise pages are added as the
+// writer first reaches them, so a short chunked response never costs the
+// whole budget.
+//
+// In segmented mode several Range requests fill the window ahead of the
+// reader, each writing at its own offset; end then only covers the prefix
+// where every segment has arrived.
+struct RemoteStream {
+    std::mutex mx;
+    std::condition_variable cv;
+    std::vector<std::unique_ptr<char[]>> pages;
+    size_t capacity = 0;
+    size_t allocated = 0;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    uint64_t read_pos = 0;
+    uint64_t epoch = 0;
+    curl_off_t content_length = -1;
+    std::string etag;
+    std::chrono::steady_clock::time_point first_byte_at;
+    bool writer_blocked = false;
+    bool done = false;
+    bool failed = false;
+    bool closed = false;
+
+    bool segmented = false;
+    int parallel = 1;
+    uint64_t next_segment = 0;
+    std::vector<StreamSegment> segments;
+
+    ~RemoteStream();
+};
+
+// Shared by the submitter and the network thread; the result is handed back
+// through the future once the transfer finishes, fails or is cancelled.
+struct NetRequest {
+    uint64_t id = 0;
+    NetRequestKind kind = NET_DOWNLOAD;
+    std::string url;
+    std::string username;
+    std::string password;
+    std::string method;
+    std::vector<std::string> request_headers;
+    std::string request_body;
+    curl_off_t range_start = -1;
+    curl_off_t range_end = -1;
+    std::string host;
+    std::atomic<int> priority{PRIO_PLAYBACK};
+    bool paused = false;
+    std::atomic<const std::atomic<uint64_t>*> cancel_latest{nullptr};
+    std::atomic<uint64_t> cancel_generation{0};
+    std::shared_ptr<RemoteStream> stream;
+    uint64_t stream_epoch = 0;
+    bool blocked = false;
+    bool changed = false;
+    bool bad_range = false;
+    bool segment = false;
+    int attempts = 0;
+    std::chrono::steady_clock::time_point retry_at;
+
+    CURL* easy = nullptr;
+    curl_slist* headers = nullptr;
+    NetResult result;
+    std::promise<NetResult> promise;
+    std::shared_future<NetResult> future = promise.get_future().share();
+
+    void cancel_when_stale(FetchCancel cancel) {
+        cancel_generation = cancel.generation;
+        cancel_latest.store(cancel.latest, std::memory_order_release);
+    }
+
+    bool stale() const {
+        const std::atomic<uint64_t>* latest = cancel_latest.load(std::memory_order_acquire);
+        return latest && latest->load() != cancel_generation;
+    }
+};
+
+static const size_t NET_QUEUE_SIZE = 256;
+
+struct NetworkClient {
+    CURLM* multi = nullptr;
+    std::thread thread;
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> next_id{1};
+    MpscRing<std::shared_ptr<NetRequest>, NET_QUEUE_SIZE> submissions;
+    MpscRing<uint64_t, NET_QUEUE_SIZE> cancels;
+    std::unordered_map<uint64_t, std::shared_ptr<NetRequest>> active;
+    std::vector<std::shared_ptr<NetRequest>> pending;
+    std::vector<std::shared_ptr<NetRequest>> segment_leaders;
+    std::unordered_map<std::string, int> host_active;
+    int segments = 0;
+    TokenBucket buckets[PRIO_COUNT];
+    bool shaping = false;
+
+    std::atomic<ma_uint64> class_bytes[PRIO_COUNT] = {};
+
+    std::atomic<unsigned> active_count{0};
+    std::atomic<ma_uint64> completed{0};
+    std::atomic<ma_uint64> cancelled{0};
+    std::atomic<ma_uint64> window_bytes{0};
+    std::atomic<ma_uint64> refetches{0};
+    std::atomic<ma_uint64> resumes{0};
+};
+
+static NetworkClient g_net;
+
+// The UI sleeps until a key arrives or this eventfd is written, so threads
+// with something new to show (library changes, engine state) wake it here.
+static int g_ui_wake_fd = -1;
+
+void wake_ui() {
+    if (g_ui_wake_fd >= 0) eventfd_write(g_ui_wake_fd, 1);
+}
+
+RemoteStream::~RemoteStream() {
+    g_net.window_bytes -= allocated;
+}
+
+static uint64_t stream_floor(const RemoteStream &stream) {
+    return stream.read_pos > REMOTE_KEEP_BEHIND ? stream.read_pos - REMOTE_KEEP_BEHIND : 0;
+}
+
+static size_t stream_room(const RemoteStream &stream) {
+    uint64_t keep_from = std::max(stream.start, std::min(stream_floor(stream), stream.end));
+    return stream.capacity - (size_t)(stream.end - keep_from);
+}
+
+static bool stream_resumable(const RemoteStream &stream) {
+    return stream_room(stream) >= std::min(REMOTE_RESUME_ROOM, stream.capacity / 4);
+}
+
+static char* stream_page(RemoteStream &stream, size_t index) {
+    std::unique_ptr<char[]> &page = stream.pages[index];
+    if (!page) {
+        page.reset(new char[STREAM_PAGE_BYTES]);
+        stream.allocated += STREAM_PAGE_BYTES;
+        g_net.window_bytes += STREAM_PAGE_BYTES;
+    }
+    return page.get();
+}
+
+// The length may be a listing's guess, and the window is never resized, so
+// it always keeps room for REMOTE_KEEP_BEHIND plus a resume's worth ahead,
+// or, when segmented, for every segment in flight plus the next one. A
+// smaller window would stall the writer for good on a longer file.
+static size_t stream_min_window(const RemoteStream &stream) {
+    if (stream.segmented) return REMOTE_KEEP_BEHIND + (size_t)(stream.parallel + 1) * NET_SEGMENT_BYTES;
+    return REMOTE_KEEP_BEHIND + REMOTE_RESUME_ROOM;
+}
+
+static void stream_allocate(RemoteStream &stream, size_t min_capacity, curl_off_t length) {
+    if (stream.capacity > 0) return;
+    size_t capacity = REMOTE_WINDOW_BYTES;
+    if (length > 0) capacity = std::min(capacity, std::max((size_t)length, stream_min_window(stream)));
+    capacity = std::max(capacity, min_capacity);
+    stream.pages.resize((capacity + STREAM_PAGE_BYTES - 1) / STREAM_PAGE_BYTES);
+    stream.capacity = stream.pages.size() * STREAM_PAGE_BYTES;
+    if (length > 0) {
+        size_t pages = std::min(stream.pages.size(), ((size_t)length + STREAM_PAGE_BYTES - 1) / STREAM_PAGE_BYTES);
+        for (size_t i = 0; i < pages; i++) stream_page(stream, i);
+    }
+}
+
+// Page-aware cursor over the window: each byte goes straight between the
+// caller's buffer and the page that holds it, whatever the page boundaries.
+static void stream_copy_in(RemoteStream &stream, uint64_t pos, const char* data, size_t len) {
+    while (len > 0) {
+        size_t at = pos % stream.capacity;
+        size_t n = std::min(STREAM_PAGE_BYTES - at % STREAM_PAGE_BYTES, len);
+        memcpy(stream_page(stream, at / STREAM_PAGE_BYTES) + at % STREAM_PAGE_BYTES, data, n);
+        pos += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static void stream_copy_out(const RemoteStream &stream, uint64_t pos, char* data, size_t len) {
+    while (len > 0) {
+        size_t at = pos % stream.capacity;
+        size_t n = std::min(STREAM_PAGE_BYTES - at % STREAM_PAGE_BYTES, len);
+        memcpy(data, stream.pages[at / STREAM_PAGE_BYTES].get() + at % STREAM_PAGE_BYTES, n);
+        pos += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// Appends all of len or nothing, so a paused transfer can hand the same bytes over again.
+static bool stream_append(RemoteStream &stream, const char* data, size_t len) {
+    stream_allocate(stream, len, stream.content_length);
+    uint64_t new_end = stream.end + len;
+    uint64_t keep_from = std::max(stream.start, std::min(stream_floor(stream), new_end));
+    if (new_end - keep_from > stream.capacity) return false;
+
+    uint64_t from = std::max(stream.end, keep_from);
+    stream_copy_in(stream, from, data + (from - stream.end), (size_t)(new_end - from));
+    stream.start = keep_from;
+    stream.end = new_end;
+    return true;
+}
+
+// Segments are only handed out inside the window, so a write never lands on
+// bytes the reader still needs.
+static void stream_write_at(RemoteStream &stream, uint64_t pos, const char* data, size_t len) {
+    stream_copy_in(stream, pos, data, len);
+    if (pos + len > stream.capacity) stream.start = std::max(stream.start, pos + len - stream.capacity);
+}
+
+static void stream_settle_segments(RemoteStream &stream) {
+    uint64_t end = stream.next_segment;
+    for (const StreamSegment &seg : stream.segments) {
+        if (seg.received < seg.size) {
+            end = seg.start + seg.received;
+            break;
+        }
+    }
+    stream.end = std::max(stream.end, end);
+    stream.segments.erase(std::remove_if(stream.segments.begin(), stream.segments.end(), [&](const StreamSegment &seg) {
+        return seg.start + seg.size <= stream.end;
+    }), stream.segments.end());
+    bool all_assigned = stream.content_length < 0 || stream.next_segment >= (uint64_t)stream.content_length;
+    if (stream.segments.empty() && all_assigned) stream.done = true;
+}
+
+static void stream_set_length(RemoteStream &stream, curl_off_t length) {
+    stream.content_length = length;
+    if (!stream.segmented || length < 0) return;
+    stream.next_segment = std::min<uint64_t>(stream.next_segment, length);
+    for (StreamSegment &seg : stream.segments) seg.size = std::min<uint64_t>(seg.size, length - std::min<uint64_t>(seg.start, length));
+}
+
+static StreamSegment* find_segment(RemoteStream &stream, uint64_t request) {
+    for (StreamSegment &seg : stream.segments) {
+        if (seg.request == request) return &seg;
+    }
+    return nullptr;
+}
+
+static size_t curl_header_callback(char* buffer, size_t size, size_t nitems, void* userp) {
+    size_t len = size * nitems;
+    NetRequest* req = (NetRequest*)userp;
+    std::string line(buffer, len);
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) return len;
+
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    std::string value = line.substr(colon + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t\r\n") + 1);
+
+    if (name == "etag") req->result.etag = value;
+    else if (name == "last-modified") req->result.last_modified = value;
+    else if (name == "content-type") req->result.content_type = value;
+    else if (name == "content-range" && value.find('/') != std::string::npos && value.back() != '*') {
+        const char* total = value.c_str() + value.find('/') + 1;
+        char* end;
+        errno = 0;
+        long long length = strtoll(total, &end, 10);
+        if (errno != 0 || end == total || *end != '\0' || length < 0) req->bad_range = true;
+        else req->result.resource_length = length;
+    }
+    return len;
+}
+
+static size_t net_write_callback(void* contents, size_t size, size_t nmemb, void* userp) {
+    NetRequest* req = (NetRequest*)userp;
+    size_t len = size * nmemb;
+    int prio = req->priority;
+    if (g_net.shaping && NET_SHAPED_RATE[prio] > 0) {
+        TokenBucket &bucket = g_net.buckets[prio];
+        if (bucket.tokens < 0) {
+            req->paused = true;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        bucket.tokens -= len;
+    }
+    g_net.class_bytes[prio] += len;
+    if (!req->stream) {
+        reserve_body(req->easy, req->result.body);
+        return curl_write_memory_callback(contents, size, nmemb, &req->result.body);
+    }
+
+    RemoteStream &stream = *req->stream;
+    {
+        std::lock_guard<std::mutex> lock(stream.mx);
+        if (req->stream_epoch != stream.epoch || stream.closed) return 0;
+        if (req->result.status == 0) {
+            curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &req->result.status);
+            // Where a range starts and how long the file is can't be trusted; neither can a retry.
+            if (req->bad_range) return 0;
+            if (stream.etag.empty()) {
+                stream.etag = req->result.etag;
+            } else if (!req->result.etag.empty() && req->result.etag != stream.etag) {
+                req->changed = true;
+                return 0;
+            }
+            // A server that ignores Range sends the file from the top; the window skips to the reader.
+            if (req->range_start > 0 && req->result.status == 200) stream.start = stream.end = 0;
+            if (req->segment && req->result.status == 200) {
+                stream.segmented = false;
+                stream.segments.clear();
+                req->segment = false;
+                req->range_end = -1;
+            }
+        }
+        if (stream.content_length < 0) {
+            curl_off_t length = req->result.resource_length;
+            if (length < 0 && req->range_start <= 0 && req->range_end < 0) {
+                curl_easy_getinfo(req->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+            }
+            if (length >= 0) stream_set_length(stream, length);
+        }
+        if (stream.first_byte_at == std::chrono::steady_clock::time_point{}) stream.first_byte_at = std::chrono::steady_clock::now();
+
+        if (req->segment) {
+            StreamSegment* seg = find_segment(stream, req->id);
+            if (!seg) return 0;
+            stream_allocate(stream, len, stream.content_length);
+            size_t n = (size_t)std::min<uint64_t>(len, seg->size - seg->received);
+            stream_write_at(stream, seg->start + seg->received, (char*)contents, n);
+            seg->received += n;
+            stream_settle_segments(stream);
+        } else if (!stream_append(stream, (char*)contents, len)) {
+            stream.writer_blocked = true;
+            req->blocked = true;
+            g_net.class_bytes[prio] -= len;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        req->attempts = 0;
+    }
+    stream.cv.notify_all();
+    return len;
+}
+
+std::string url_host(const std::string &url) {
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    size_t end = url.find_first_of("/?#", start);
+    std::string authority = url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    size_t at = authority.rfind('@');
+    return at == std::string::npos ? authority : authority.substr(at + 1);
+}
+
+NetPriority default_priority(NetRequestKind kind) {
+    switch (kind) {
+        case NET_PREFETCH: return PRIO_NEXT_TRACK;
+        case NET_LISTING: return PRIO_METADATA;
+        default: return PRIO_PLAYBACK;
+    }
+}
+
+// A size known from the listing lets the window be allocated here, before the
+// transfer starts, instead of on the network thread.
+std::shared_ptr<NetRequest> make_net_request(NetRequestKind kind, const std::string &url,
+                                             const std::string &username, const std::string &password,
+                                             int64_t size_hint = -1) {
+    auto req = std::make_shared<NetRequest>();
+    req->kind = kind;
+    req->url = url;
+    req->host = url_host(url);
+    req->priority = default_priority(kind);
+    req->username = username;
+    req->password = password;
+    if (kind == NET_DOWNLOAD || kind == NET_PREFETCH) {
+        req->stream = std::make_shared<RemoteStream>();
+        if (g_net.segments > 1) {
+            req->stream->segmented = true;
+            req->stream->parallel = g_net.segments;
+            req->segment = true;
+            req->range_start = 0;
+            req->range_end = NET_SEGMENT_BYTES - 1;
+        }
+        if (size_hint > 0) stream_allocate(*req->stream, 0, size_hint);
+    }
+    return req;
+}
 
-    std::vector<char> response_data;
+static void net_complete(NetworkClient &net, NetRequest &req, CURLcode code) {
+    req.result.code = code;
+    if (req.stream) {
+        std::lock_guard<std::mutex> lock(req.stream->mx);
+        if (req.stream_epoch == req.stream->epoch) {
+            StreamSegment* seg = req.segment ? find_segment(*req.stream, req.id) : nullptr;
+            if (!req.segment || code != CURLE_OK || (seg && seg->received < seg->size)) {
+                req.stream->done = true;
+                req.stream->failed = code != CURLE_OK || seg;
+            }
+            req.stream->cv.notify_all();
+        }
+    }
+    if (code == CURLE_ABORTED_BY_CALLBACK) net.cancelled++;
+    else net.completed++;
+    req.promise.set_value(std::move(req.result));
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_memory_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_data);
+static void net_attach(NetworkClient &net, const std::shared_ptr<NetRequest> &req) {
+    CURL* curl = curl_easy_init();
+    if (!curl) {
+        net_complete(net, *req, CURLE_FAILED_INIT);
+        return;
+    }
+    req->easy = curl;
+    curl_easy_setopt(curl, CURLOPT_URL, req->url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, net_write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, req.get());
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header_callback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, req.get());
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, req.get());
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 
-    if (!username.empty()) {
-        std::string userpass = username + ":" + password;
+    if (!req->username.empty()) {
+        std::string userpass = req->username + ":" + req->password;
         curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
         curl_easy_setopt(curl, CURLOPT_USERPWD, userpass.c_str());
     }
+    if (!req->method.empty()) curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, req->method.c_str());
+    if (!req->request_body.empty()) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->request_body.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)req->request_body.size());
+    }
+    for (const std::string &header : req->request_headers) req->headers = curl_slist_append(req->headers, header.c_str());
+    if (req->range_start >= 0) {
+        std::string range = std::to_string(req->range_start) + "-" +
+                            (req->range_end >= 0 ? std::to_string(req->range_end) : "");
+        curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+    }
+    if (req->stream) {
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, NET_STALL_SECONDS);
+        std::lock_guard<std::mutex> lock(req->stream->mx);
+        RemoteStream &stream = *req->stream;
+        // The first segment of a stream leads: the scheduler hands out the rest from it.
+        if (req->segment && req->stream_epoch == stream.epoch && !find_segment(stream, req->id)) {
+            uint64_t size = (uint64_t)(req->range_end - req->range_start + 1);
+            stream.segments.push_back({(uint64_t)req->range_start, size, 0, req->id});
+            stream.next_segment = std::max<uint64_t>(stream.next_segment, req->range_start + size);
+            stream_set_length(stream, stream.content_length);
+            net.segment_leaders.erase(std::remove_if(net.segment_leaders.begin(), net.segment_leaders.end(),
+                                                     [&](const std::shared_ptr<NetRequest> &l) { return l->stream == req->stream; }),
+                                      net.segment_leaders.end());
+            net.segment_leaders.push_back(req);
+        }
+        if (req->range_start > 0 && !req->stream->etag.empty()) {
+            req->headers = curl_slist_append(req->headers, ("If-Range: " + req->stream->etag).c_str());
+        }
+    }
+    if (req->headers) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+
+    net.active[req->id] = req;
+    net.active_count = net.active.size();
+    net.host_active[req->host]++;
+    curl_multi_add_handle(net.multi, curl);
+}
+
+static bool net_should_resume(const NetRequest &req, CURLcode code) {
+    if (!req.stream || req.changed || req.bad_range || req.attempts >= NET_MAX_RETRIES) return false;
+    switch (code) {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// A dropped stream picks up where its window ends, after an exponential
+// backoff; If-Range and the ETag check keep a changed file from being spliced in.
+static bool net_requeue(NetworkClient &net, const std::shared_ptr<NetRequest> &req) {
+    {
+        std::lock_guard<std::mutex> lock(req->stream->mx);
+        if (req->stream_epoch != req->stream->epoch || req->stream->closed) return false;
+        if (req->segment) {
+            StreamSegment* seg = find_segment(*req->stream, req->id);
+            if (!seg) return false;
+            req->range_start = (curl_off_t)(seg->start + seg->received);
+        } else {
+            req->range_start = (curl_off_t)req->stream->end;
+        }
+    }
+    auto delay = std::min<std::chrono::steady_clock::duration>(NET_RETRY_BASE_DELAY * (1 << req->attempts), NET_RETRY_MAX_DELAY);
+    req->attempts++;
+    req->retry_at = std::chrono::steady_clock::now() + delay;
+    req->result.status = 0;
+    req->result.etag.clear();
+    req->paused = false;
+    req->blocked = false;
+    net.pending.push_back(req);
+    net.resumes++;
+    return true;
+}
+
+static void net_finish(NetworkClient &net, uint64_t id, CURLcode code) {
+    auto it = net.active.find(id);
+    if (it == net.active.end()) {
+        auto queued = std::find_if(net.pending.begin(), net.pending.end(),
+                                   [id](const std::shared_ptr<NetRequest> &r) { return r->id == id; });
+        if (queued == net.pending.end()) return;
+        std::shared_ptr<NetRequest> req = *queued;
+        net.pending.erase(queued);
+        net_complete(net, *req, code);
+        return;
+    }
+    std::shared_ptr<NetRequest> req = it->second;
+    net.active.erase(it);
+    net.active_count = net.active.size();
+    if (--net.host_active[req->host] <= 0) net.host_active.erase(req->host);
+
+    curl_multi_remove_handle(net.multi, req->easy);
+    curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &req->result.status);
+    curl_easy_getinfo(req->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &req->result.content_length);
+    curl_easy_cleanup(req->easy);
+    req->easy = nullptr;
+    curl_slist_free_all(req->headers);
+    req->headers = nullptr;
+    if (net_should_resume(*req, code) && net_requeue(net, req)) return;
+    net_complete(net, *req, code);
+}
+
+// Highest class first; background classes leave one connection per host free
+// so a playback request never waits behind them.
+static void net_schedule(NetworkClient &net) {
+    std::stable_sort(net.pending.begin(), net.pending.end(),
+                     [](const std::shared_ptr<NetRequest> &a, const std::shared_ptr<NetRequest> &b) {
+                         return a->priority < b->priority;
+                     });
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < net.pending.size();) {
+        std::shared_ptr<NetRequest> req = net.pending[i];
+        if (req->retry_at > now) {
+            i++;
+            continue;
+        }
+        int limit = req->priority == PRIO_PLAYBACK ? NET_MAX_PER_HOST : NET_MAX_PER_HOST - 1;
+        if (net.host_active[req->host] >= limit) {
+            i++;
+            continue;
+        }
+        net.pending.erase(net.pending.begin() + i);
+        net_attach(net, req);
+    }
+}
+
+// Keeps each segmented stream's quota of Range requests running. Segments are
+// handed out in file order, so the one under the read cursor is always asked
+// for first, and only while they fit in the window.
+static void net_schedule_segments(NetworkClient &net) {
+    for (size_t i = 0; i < net.segment_leaders.size();) {
+        std::shared_ptr<NetRequest> leader = net.segment_leaders[i];
+        RemoteStream &stream = *leader->stream;
+        std::vector<std::shared_ptr<NetRequest>> spawned;
+        bool finished;
+        {
+            std::lock_guard<std::mutex> lock(stream.mx);
+            finished = stream.closed || stream.done || !stream.segmented || leader->stale() ||
+                       leader->stream_epoch != stream.epoch;
+            if (!finished && stream.content_length >= 0 && stream.capacity > 0) {
+                stream.writer_blocked = false;
+                uint64_t limit = stream_floor(stream) + stream.capacity;
+                int running = (int)std::count_if(stream.segments.begin(), stream.segments.end(),
+                                                 [](const StreamSegment &seg) { return seg.received < seg.size; });
+                for (; running < stream.parallel && stream.next_segment < (uint64_t)stream.content_length; running++) {
+                    uint64_t start = stream.next_segment;
+                    uint64_t size = std::min<uint64_t>(NET_SEGMENT_BYTES, stream.content_length - start);
+                    if (start + size > limit) {
+                        stream.writer_blocked = true;
+                        break;
+                    }
+                    auto req = make_net_request(NET_RANGE, leader->url, leader->username, leader->password);
+                    req->id = net.next_id++;
+                    req->stream = leader->stream;
+                    req->stream_epoch = stream.epoch;
+                    req->segment = true;
+                    req->range_start = (curl_off_t)start;
+                    req->range_end = (curl_off_t)(start + size - 1);
+                    req->cancel_generation = leader->cancel_generation.load();
+                    req->cancel_latest.store(leader->cancel_latest.load());
+                    stream.segments.push_back({start, size, 0, req->id});
+                    stream.next_segment += size;
+                    spawned.push_back(req);
+                }
+            }
+        }
+        for (auto &req : spawned) net.pending.push_back(req);
+        // A prefetch promoted to playback takes its segments along.
+        for (auto &queued : net.pending) {
+            if (queued->stream == leader->stream) queued->priority = leader->priority.load();
+        }
+        for (auto &entry : net.active) {
+            if (entry.second->stream == leader->stream) entry.second->priority = leader->priority.load();
+        }
+        if (finished) net.segment_leaders.erase(net.segment_leaders.begin() + i);
+        else i++;
+    }
+}
+
+static void net_update_shaping(NetworkClient &net) {
+    net.shaping = std::any_of(net.active.begin(), net.active.end(), [](const std::pair<const uint64_t, std::shared_ptr<NetRequest>> &e) {
+        return e.second->priority == PRIO_PLAYBACK;
+    });
+    for (int p = 0; p < PRIO_COUNT; p++) {
+        net.buckets[p].rate = NET_SHAPED_RATE[p];
+        net.buckets[p].refill();
+    }
+    for (auto &entry : net.active) {
+        NetRequest &req = *entry.second;
+        if (!req.paused && !req.blocked) continue;
+        if (req.paused && net.shaping && net.buckets[req.priority].tokens < 0) continue;
+        if (req.blocked) {
+            std::lock_guard<std::mutex> lock(req.stream->mx);
+            if (!stream_resumable(*req.stream)) continue;
+            req.stream->writer_blocked = false;
+        }
+        req.paused = false;
+        req.blocked = false;
+        curl_easy_pause(req.easy, CURLPAUSE_CONT);
+    }
+}
+
+void network_loop(NetworkClient* net) {
+    apply_thread_role(ROLE_NETWORK);
+    std::vector<uint64_t> stale;
+
+    while (!net->stop) {
+        std::shared_ptr<NetRequest> req;
+        while (net->submissions.pop(req)) net->pending.push_back(req);
+
+        uint64_t id;
+        while (net->cancels.pop(id)) net_finish(*net, id, CURLE_ABORTED_BY_CALLBACK);
+
+        stale.clear();
+        for (auto &entry : net->active) {
+            if (entry.second->stale()) stale.push_back(entry.first);
+        }
+        for (auto &queued : net->pending) {
+            if (queued->stale()) stale.push_back(queued->id);
+        }
+        for (uint64_t sid : stale) net_finish(*net, sid, CURLE_ABORTED_BY_CALLBACK);
+
+        net_schedule_segments(*net);
+        net_schedule(*net);
+        net_update_shaping(*net);
+
+        int running = 0;
+        curl_multi_perform(net->multi, &running);
+
+        int pending;
+        bool finished = false;
+        while (CURLMsg* msg = curl_multi_info_read(net->multi, &pending)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            NetRequest* done = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&done);
+            net_finish(*net, done->id, msg->data.result);
+            finished = true;
+        }
+        // A finished transfer frees a slot; fill it now rather than after the next poll.
+        if (finished) continue;
+
+        bool throttled = std::any_of(net->active.begin(), net->active.end(), [](const std::pair<const uint64_t, std::shared_ptr<NetRequest>> &e) {
+            return e.second->paused;
+        });
+        int timeout_ms = throttled ? 20 : 1000;
+        auto now = std::chrono::steady_clock::now();
+        for (auto &queued : net->pending) {
+            if (queued->retry_at <= now) continue;
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(queued->retry_at - now).count() + 1;
+            timeout_ms = std::min<int>(timeout_ms, (int)wait);
+        }
+        curl_multi_poll(net->multi, nullptr, 0, timeout_ms, nullptr);
+    }
+
+    while (!net->active.empty()) net_finish(*net, net->active.begin()->first, CURLE_ABORTED_BY_CALLBACK);
+    while (!net->pending.empty()) net_finish(*net, net->pending.front()->id, CURLE_ABORTED_BY_CALLBACK);
+}
+
+void net_wakeup(NetworkClient &net) {
+    if (net.multi) curl_multi_wakeup(net.multi);
+}
+
+uint64_t net_submit(NetworkClient &net, const std::shared_ptr<NetRequest> &req) {
+    req->id = net.next_id++;
+    while (!net.submissions.push(req)) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    net_wakeup(net);
+    return req->id;
+}
+
+void net_cancel(NetworkClient &net, uint64_t id) {
+    while (!net.cancels.push(id)) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    net_wakeup(net);
+}
+
+bool start_network(NetworkClient &net) {
+    net.multi = curl_multi_init();
+    if (!net.multi) return false;
+    if (const char* segments = getenv("COOKIE_SEGMENTS")) net.segments = std::max(0, std::min(NET_MAX_SEGMENTS, atoi(segments)));
+    net.stop = false;
+    net.thread = std::thread(network_loop, &net);
+    return true;
+}
+
+void stop_network(NetworkClient &net) {
+    if (!net.multi) return;
+    net.stop = true;
+    net_wakeup(net);
+    net.thread.join();
+    curl_multi_cleanup(net.multi);
+    net.multi = nullptr;
+}
+
+// Directory listings come in several dialects. Auto-detection tries a WebDAV
+// PROPFIND first, then a GET asking for JSON (nginx autoindex_format json,
+// Caddy browse) and falls back to the anchors of an HTML index. The format a
+// host answered with is remembered; COOKIE_LISTING=html|webdav|nginx|caddy skips
+// the probing.
+enum ListingFormat { LISTING_AUTO, LISTING_HTML, LISTING_WEBDAV, LISTING_NGINX, LISTING_CADDY, LISTING_FORMAT_COUNT };
+
+static const char* LISTING_FORMAT_NAMES[LISTING_FORMAT_COUNT] = {"auto", "html", "webdav", "nginx", "caddy"};
+
+static const char* PROPFIND_BODY =
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+    "<D:propfind xmlns:D=\"DAV:\"><D:prop>"
+    "<D:resourcetype/><D:getcontentlength/><D:getlastmodified/>"
+    "</D:prop></D:propfind>";
+
+static std::mutex g_listing_mx;
+static std::unordered_map<std::string, ListingFormat> g_listing_formats;
+
+std::string url_encode(const std::string &value) {
+    static const char* HEX = "0123456789ABCDEF";
+    std::string result;
+    for (unsigned char c : value) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            result += (char)c;
+        } else {
+            result += '%';
+            result += HEX[c >> 4];
+            result += HEX[c & 15];
+        }
+    }
+    return result;
+}
+
+static std::string url_path(const std::string &url) {
+    size_t scheme = url.find("://");
+    size_t slash = url.find('/', scheme == std::string::npos ? 0 : scheme + 3);
+    std::string path = slash == std::string::npos ? "/" : url.substr(slash);
+    path = path.substr(0, path.find_first_of("?#"));
+    while (path.size() > 1 && path.back() == '/') path.pop_back();
+    return url_decode(path);
+}
+
+// "2024-01-31T12:00:00.5+01:00" as sent by Caddy.
+static time_t parse_iso8601(const std::string &value) {
+    struct tm tm = {};
+    if (sscanf(value.c_str(), "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    time_t t = timegm(&tm);
+    size_t zone = value.find_first_of("+-", 19);
+    int hours = 0, minutes = 0;
+    if (zone != std::string::npos && sscanf(value.c_str() + zone + 1, "%d:%d", &hours, &minutes) == 2) {
+        t -= (value[zone] == '+' ? 1 : -1) * (hours * 3600 + minutes * 60);
+    }
+    return t;
+}
+
+static time_t parse_http_date(const std::string &value) {
+    time_t t = curl_getdate(value.c_str(), nullptr);
+    return t < 0 ? 0 : t;
+}
+
+static void add_listing_entry(std::vector<MusicEntry> &entries, std::string name, bool dir, int64_t size, time_t mtime) {
+    if (name.rfind("./", 0) == 0) name.erase(0, 2);
+    while (!name.empty() && name.back() == '/') {
+        name.pop_back();
+        dir = true;
+    }
+    // Listings are one level deep, so a name with a slash left in it points elsewhere.
+    if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) return;
+    MusicEntry entry;
+    entry.name = name;
+    entry.dir = dir;
+    entry.size = dir ? -1 : size;
+    entry.mtime = mtime;
+    entries.push_back(entry);
+}
+
+static bool parse_html_listing(const std::vector<char> &body, std::vector<MusicEntry> &entries) {
+    const char* html = body.data();
+    std::regex href_regex(R"(<a\s+href=["']([^"'>]+)["'])", std::regex::icase);
+    auto begin = std::cregex_iterator(html, html + body.size(), href_regex);
+    auto end = std::cregex_iterator();
+
+    for (auto i = begin; i != end; ++i) {
+        std::string link = (*i)[1].str();
+        // Only plain relative links: sort-order queries, parents and absolute links are navigation.
+        if (link[0] == '/' || link[0] == '?' || link[0] == '#' || link.find("://") != std::string::npos) continue;
+        add_listing_entry(entries, link, false, -1, 0);
+    }
+    return true;
+}
+
+// Finds the next element with the given local name, whatever its namespace
+// prefix, and returns its content. Enough for the flat multistatus replies of
+// PROPFIND; not a general XML parser.
+static bool xml_element(const char* &p, const char* end, const char* name, std::string &content) {
+    size_t name_len = strlen(name);
+    auto local_name_at = [&](const char* q) {
+        const char* tag_end = q;
+        while (tag_end < end && !isspace((unsigned char)*tag_end) && *tag_end != '>' && *tag_end != '/') tag_end++;
+        const char* local = tag_end;
+        while (local > q && local[-1] != ':') local--;
+        return (size_t)(tag_end - local) == name_len && strncmp(local, name, name_len) == 0 ? tag_end : nullptr;
+    };
+    for (const char* q = p; (q = (const char*)memchr(q, '<', end - q)); q++) {
+        if (q + 1 >= end || q[1] == '/' || q[1] == '?' || q[1] == '!') continue;
+        const char* tag_end = local_name_at(q + 1);
+        if (!tag_end) continue;
+        const char* close = (const char*)memchr(tag_end, '>', end - tag_end);
+        if (!close) return false;
+        if (close[-1] == '/') {
+            content.clear();
+            p = close + 1;
+            return true;
+        }
+        for (const char* c = close + 1; (c = (const char*)memchr(c, '<', end - c)); c++) {
+            if (c + 1 < end && c[1] == '/' && local_name_at(c + 2)) {
+                content.assign(close + 1, c);
+                p = c;
+                return true;
+            }
+        }
+        return false;
+    }
+    return false;
+}
+
+static bool parse_webdav_listing(const std::string &url, const std::vector<char> &body, std::vector<MusicEntry> &entries) {
+    std::string self = url_path(url);
+    const char* p = body.data();
+    const char* end = p + body.size();
+    std::string response;
+    bool any = false;
+    while (xml_element(p, end, "response", response)) {
+        any = true;
+        const char* r = response.data();
+        const char* r_end = r + response.size();
+        std::string href, length, modified, type, collection;
+        const char* q = r;
+        if (!xml_element(q, r_end, "href", href)) continue;
+        bool dir = false;
+        q = r;
+        if (xml_element(q, r_end, "resourcetype", type)) {
+            const char* t = type.data();
+            dir = xml_element(t, t + type.size(), "collection", collection);
+        }
+        q = r;
+        xml_element(q, r_end, "getcontentlength", length);
+        q = r;
+        xml_element(q, r_end, "getlastmodified", modified);
+
+        if (url_path(href) == self) continue;
+        while (href.size() > 1 && href.back() == '/') href.pop_back();
+        add_listing_entry(entries, href.substr(href.find_last_of('/') + 1), dir,
+                          length.empty() ? -1 : atoll(length.c_str()), modified.empty() ? 0 : parse_http_date(modified));
+    }
+    return any;
+}
+
+static void json_skip_ws(const char* &p, const char* end) {
+    while (p < end && isspace((unsigned char)*p)) p++;
+}
+
+static void append_utf8(std::string &out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+static bool json_string(const char* &p, const char* end, std::string &out) {
+    out.clear();
+    if (p >= end || *p != '"') return false;
+    for (p++; p < end; p++) {
+        if (*p == '"') {
+            p++;
+            return true;
+        }
+        if (*p != '\\') {
+            out += *p;
+            continue;
+        }
+        if (++p >= end) return false;
+        switch (*p) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                if (end - p < 5) return false;
+                uint32_t cp = (uint32_t)strtoul(std::string(p + 1, 4).c_str(), nullptr, 16);
+                p += 4;
+                if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 7 && p[1] == '\\' && p[2] == 'u') {
+                    uint32_t low = (uint32_t)strtoul(std::string(p + 3, 4).c_str(), nullptr, 16);
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                append_utf8(out, cp);
+                break;
+            }
+            default: out += *p; break;
+        }
+    }
+    return false;
+}
+
+// The autoindex formats are arrays of flat objects, so values are only ever
+// strings, numbers or literals.
+static bool json_value(const char* &p, const char* end, std::string &out) {
+    json_skip_ws(p, end);
+    if (p < end && *p == '"') return json_string(p, end, out);
+    const char* start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && !isspace((unsigned char)*p)) p++;
+    out.assign(start, p);
+    return p > start && *start != '{' && *start != '[';
+}
+
+static bool parse_json_listing(const std::vector<char> &body, std::vector<MusicEntry> &entries, ListingFormat &format) {
+    const char* p = body.data();
+    const char* end = p + body.size();
+    json_skip_ws(p, end);
+    if (p >= end || *p != '[') return false;
+    p++;
+    std::string key, value;
+    for (;;) {
+        json_skip_ws(p, end);
+        if (p < end && *p == ',') p++;
+        json_skip_ws(p, end);
+        if (p < end && *p == ']') return true;
+        if (p >= end || *p != '{') return false;
+        p++;
+
+        std::string name, link, type;
+        int64_t size = -1;
+        time_t mtime = 0;
+        bool dir = false;
+        for (;;) {
+            json_skip_ws(p, end);
+            if (p < end && *p == ',') p++;
+            json_skip_ws(p, end);
+            if (p < end && *p == '}') {
+                p++;
+                break;
+            }
+            if (!json_string(p, end, key)) return false;
+            json_skip_ws(p, end);
+            if (p >= end || *p++ != ':') return false;
+            if (!json_value(p, end, value)) return false;
+
+            if (key == "name") name = value;
+            else if (key == "url") link = value;
+            else if (key == "size") size = atoll(value.c_str());
+            else if (key == "type") dir = value == "directory";
+            else if (key == "is_dir") dir = value == "true";
+            else if (key == "mtime") mtime = parse_http_date(value);
+            else if (key == "mod_time") mtime = parse_iso8601(value);
+            if (key == "mod_time" || key == "is_dir") format = LISTING_CADDY;
+            else if (key == "type" && format != LISTING_CADDY) format = LISTING_NGINX;
+        }
+        // Caddy's url is already encoded; nginx only gives the plain name.
+        add_listing_entry(entries, link.empty() ? url_encode(name) : link, dir, size, mtime);
+    }
+}
+
+// One directory as listed. etag and last_modified go out as validators and
+// come back from the server; not_modified means the cached entries still hold.
+struct DirectoryListing {
+    std::vector<MusicEntry> entries;
+    std::string etag;
+    std::string last_modified;
+    ListingFormat format = LISTING_AUTO;
+    bool not_modified = false;
+};
+
+static NetResult fetch_listing(const std::string &url, const std::string &username, const std::string &password,
+                               ListingFormat format, const DirectoryListing &listing, FetchCancel cancel) {
+    auto req = make_net_request(NET_LISTING, url, username, password);
+    req->cancel_when_stale(cancel);
+    if (format == LISTING_WEBDAV) {
+        req->method = "PROPFIND";
+        req->request_body = PROPFIND_BODY;
+        req->request_headers = {"Depth: 1", "Content-Type: application/xml; charset=utf-8"};
+    } else if (format != LISTING_HTML) {
+        req->request_headers = {"Accept: application/json, text/html;q=0.9"};
+    }
+    if (!listing.etag.empty()) req->request_headers.push_back("If-None-Match: " + listing.etag);
+    if (!listing.last_modified.empty()) req->request_headers.push_back("If-Modified-Since: " + listing.last_modified);
+    net_submit(g_net, req);
+    return req->future.get();
+}
+
+void set_listing_format(const std::string &url, ListingFormat format) {
+    std::lock_guard<std::mutex> lock(g_listing_mx);
+    g_listing_formats[url_host(url)] = format;
+}
+
+// Lists one directory: files and subdirectories, with size and mtime where
+// the format carries them. Validators already in listing make the request
+// conditional.
+bool list_remote_directory(const std::string &url, const std::string &username, const std::string &password,
+                           DirectoryListing &listing, FetchCancel cancel = {}) {
+    std::string host = url_host(url);
+    ListingFormat format = LISTING_AUTO;
+    if (const char* forced = getenv("COOKIE_LISTING")) {
+        for (int i = 0; i < LISTING_FORMAT_COUNT; i++) {
+            if (strcmp(forced, LISTING_FORMAT_NAMES[i]) == 0) format = (ListingFormat)i;
+        }
+    }
+    if (format == LISTING_AUTO) {
+        std::lock_guard<std::mutex> lock(g_listing_mx);
+        auto known = g_listing_formats.find(host);
+        if (known != g_listing_formats.end()) format = known->second;
+    }
+
+    bool ok = false;
+    ListingFormat answered = format;
+    NetResult result;
+    if (format == LISTING_AUTO || format == LISTING_WEBDAV) {
+        result = fetch_listing(url, username, password, LISTING_WEBDAV, listing, cancel);
+        if (result.code == CURLE_ABORTED_BY_CALLBACK) return false;
+        listing.not_modified = result.ok() && result.status == 304;
+        ok = listing.not_modified || (result.ok() && result.status == 207 && parse_webdav_listing(url, result.body, listing.entries));
+        if (ok) answered = LISTING_WEBDAV;
+    }
+    if (!ok && format != LISTING_WEBDAV) {
+        result = fetch_listing(url, username, password, format, listing, cancel);
+        listing.not_modified = result.ok() && result.status == 304;
+        if (listing.not_modified) {
+            ok = true;
+        } else if (result.ok()) {
+            bool json = result.content_type.find("json") != std::string::npos;
+            if (format == LISTING_NGINX || format == LISTING_CADDY || (format == LISTING_AUTO && json)) {
+                answered = LISTING_NGINX;
+                ok = parse_json_listing(result.body, listing.entries, answered);
+            } else {
+                answered = LISTING_HTML;
+                ok = parse_html_listing(result.body, listing.entries);
+            }
+        }
+    }
+    if (ok && !listing.not_modified) {
+        listing.etag = result.etag;
+        listing.last_modified = result.last_modified;
+    }
+    if (ok && answered != LISTING_AUTO) set_listing_format(url, answered);
+    listing.format = answered;
+    return ok;
+}
+
+// Remote libraries are usually Artist/Album/ trees. The crawler lists
+// directories on CRAWL_WORKERS threads, one listing each, so a crawl never
+// holds more connections to its host than playback leaves free, and down to
+// COOKIE_CRAWL_DEPTH levels.
+//
+// Every directory is kept in the listing cache with its validators. On the
+// next launch the cached tree is shown at once and the crawl revalidates it:
+// a 304 reuses the cached entries, and only directories that changed are
+// compared against the cache and reported to the UI as additions and removals.
+static const int CRAWL_WORKERS = 3;
+static const int CRAWL_DEFAULT_DEPTH = 8;
+
+struct CrawlDir {
+    std::string path;
+    int depth;
+};
+
+struct CrawledDir {
+    std::string path;
+    std::string etag;
+    std::string last_modified;
+    std::vector<MusicEntry> entries;
+};
+
+struct RemoteCrawl {
+    std::string root;
+    std::string username;
+    std::string password;
+    int max_depth = CRAWL_DEFAULT_DEPTH;
+
+    std::mutex mx;
+    std::condition_variable cv;
+    std::deque<CrawlDir> queue;
+    std::unordered_map<std::string, CrawledDir> cached;
+    int busy = 0;
+    bool failed = false;
+    std::vector<MusicEntry> added;
+    // Names of files that went away; a name ending in '/' drops a whole subtree.
+    std::vector<std::string> removed;
+    std::vector<CrawledDir> listed;
+    std::vector<std::thread> workers;
+
+    std::atomic<bool> running{false};
+    std::atomic<bool> done{false};
+    std::atomic<uint64_t> generation{0};
+    std::atomic<int> dirs_listed{0};
+};
+
+static std::string join_url(const std::string &base, const std::string &name) {
+    if (name.empty()) return base;
+    return base + (base.back() == '/' ? "" : "/") + name;
+}
+
+static std::string join_entry(const std::string &dir, const std::string &name) {
+    return dir.empty() ? name : dir + "/" + name;
+}
+
+static std::string listing_cache_path(const std::string &url, const std::string &username) {
+    std::string dir;
+    if (const char* xdg = getenv("XDG_CACHE_HOME")) dir = xdg;
+    else if (const char* home = getenv("HOME")) dir = std::string(home) + "/.cache";
+    else return "";
+    mkdir(dir.c_str(), 0755);
+    dir += "/cookie";
+    mkdir(dir.c_str(), 0755);
+
+    uint64_t hash = 1469598103934665603ull;
+    for (char c : username + "@" + url) hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+    char name[32];
+    snprintf(name, sizeof(name), "/listing-%016llx", (unsigned long long)hash);
+    return dir + name;
+}
+
+static std::vector<std::string> split_tabs(const std::string &line) {
+    std::vector<std::string> fields;
+    size_t from = 0;
+    for (size_t tab; (tab = line.find('\t', from)) != std::string::npos; from = tab + 1) fields.push_back(line.substr(from, tab - from));
+    fields.push_back(line.substr(from));
+    return fields;
+}
+
+// After the root URL and listing format, one "D etag last-modified path" line
+// per directory followed by "E dir size mtime name" lines for what it
+// contained. Names stay URL-encoded, so they never hold a tab.
+static void save_listing_cache(const std::string &url, const std::string &username, ListingFormat format,
+                               const std::vector<CrawledDir> &dirs) {
+    std::string path = listing_cache_path(url, username);
+    if (path.empty()) return;
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) return;
+    fprintf(f, "cookie-listing 2\n%s\n%s\n", url.c_str(), LISTING_FORMAT_NAMES[format]);
+    for (const CrawledDir &dir : dirs) {
+        fprintf(f, "D\t%s\t%s\t%s\n", dir.etag.c_str(), dir.last_modified.c_str(), dir.path.c_str());
+        for (const MusicEntry &e : dir.entries) {
+            fprintf(f, "E\t%d\t%lld\t%lld\t%s\n", e.dir ? 1 : 0, (long long)e.size, (long long)e.mtime, e.name.c_str());
+        }
+    }
+    bool ok = fclose(f) == 0;
+    if (ok) rename(tmp.c_str(), path.c_str());
+    else unlink(tmp.c_str());
+}
+
+bool load_listing_cache(const std::string &url, const std::string &username, std::vector<CrawledDir> &dirs) {
+    std::string path = listing_cache_path(url, username);
+    FILE* f = path.empty() ? nullptr : fopen(path.c_str(), "r");
+    if (!f) return false;
+
+    char line[8192];
+    bool ok = fgets(line, sizeof(line), f) && strcmp(line, "cookie-listing 2\n") == 0 &&
+              fgets(line, sizeof(line), f) && url + "\n" == line && fgets(line, sizeof(line), f);
+    if (ok) {
+        for (int i = 0; i < LISTING_FORMAT_COUNT; i++) {
+            if (std::string(LISTING_FORMAT_NAMES[i]) + "\n" == line && i != LISTING_AUTO) set_listing_format(url, (ListingFormat)i);
+        }
+    }
+    std::vector<CrawledDir> loaded;
+    while (ok && fgets(line, sizeof(line), f)) {
+        std::string text(line);
+        if (!text.empty() && text.back() == '\n') text.pop_back();
+        std::vector<std::string> fields = split_tabs(text);
+        if (fields[0] == "D" && fields.size() == 4) {
+            loaded.push_back({fields[3], fields[1], fields[2], {}});
+        } else if (fields[0] == "E" && fields.size() == 5 && !loaded.empty()) {
+            MusicEntry entry;
+            entry.dir = fields[1] == "1";
+            entry.size = atoll(fields[2].c_str());
+            entry.mtime = (time_t)atoll(fields[3].c_str());
+            entry.name = fields[4];
+            loaded.back().entries.push_back(std::move(entry));
+        } else {
+            ok = false;
+        }
+    }
+    fclose(f);
+    if (ok) dirs = std::move(loaded);
+    return ok;
+}
+
+// The music files of a cached tree, named relative to the root.
+std::vector<MusicEntry> cached_music_files(const std::vector<CrawledDir> &dirs) {
+    std::vector<MusicEntry> files;
+    for (const CrawledDir &dir : dirs) {
+        for (const MusicEntry &entry : dir.entries) {
+            if (entry.dir || !is_music_file(entry.name)) continue;
+            files.push_back(entry);
+            files.back().name = join_entry(dir.path, entry.name);
+        }
+    }
+    return files;
+}
+
+// Called with the crawl locked once a directory has been listed: reports what
+// differs from the cached copy, or everything when there was none.
+static void diff_crawled_dir(RemoteCrawl &c, const std::string &path, const std::vector<MusicEntry> &entries) {
+    auto cached = c.cached.find(path);
+    std::unordered_map<std::string, const MusicEntry*> before;
+    if (cached != c.cached.end()) {
+        for (const MusicEntry &entry : cached->second.entries) before[entry.name] = &entry;
+    }
+    for (const MusicEntry &entry : entries) {
+        auto old = before.find(entry.name);
+        bool existed = old != before.end();
+        bool same = existed && old->second->dir == entry.dir &&
+                    old->second->size == entry.size && old->second->mtime == entry.mtime;
+        if (existed) before.erase(old);
+        if (same || entry.dir || !is_music_file(entry.name)) continue;
+        // A changed file is replaced rather than listed twice.
+        if (existed) c.removed.push_back(join_entry(path, entry.name));
+        c.added.push_back(entry);
+        c.added.back().name = join_entry(path, entry.name);
+    }
+    for (const auto &gone : before) {
+        if (gone.second->dir) c.removed.push_back(join_entry(path, gone.first) + "/");
+        else if (is_music_file(gone.first)) c.removed.push_back(join_entry(path, gone.first));
+    }
+}
+
+static void crawl_worker(RemoteCrawl* c) {
+    apply_thread_role(ROLE_ANALYSIS);
+    std::string host = url_host(c->root);
+    FetchCancel cancel{&c->generation, c->generation.load()};
+    std::unique_lock<std::mutex> lock(c->mx);
+    for (;;) {
+        c->cv.wait(lock, [&] {
+            return !c->running || c->busy == 0 || !c->queue.empty();
+        });
+        if (!c->running || (c->queue.empty() && c->busy == 0)) break;
+        CrawlDir dir = c->queue.front();
+        c->queue.pop_front();
+        c->busy++;
+        DirectoryListing listing;
+        auto cached = c->cached.find(dir.path);
+        if (cached != c->cached.end()) {
+            listing.etag = cached->second.etag;
+            listing.last_modified = cached->second.last_modified;
+        }
+        lock.unlock();
+
+        bool ok = list_remote_directory(join_url(c->root, dir.path), c->username, c->password, listing, cancel);
+
+        lock.lock();
+        c->busy--;
+        cached = c->cached.find(dir.path);
+        // A directory that cannot be listed right now keeps its cached entries.
+        if (!ok && cached == c->cached.end()) c->failed = true;
+        if (listing.not_modified || (!ok && cached != c->cached.end())) {
+            listing.entries = cached->second.entries;
+        } else if (ok) {
+            diff_crawled_dir(*c, dir.path, listing.entries);
+        }
+        if (ok || cached != c->cached.end()) {
+            c->dirs_listed++;
+            for (const MusicEntry &entry : listing.entries) {
+                if (entry.dir && dir.depth < c->max_depth) c->queue.push_back({join_entry(dir.path, entry.name), dir.depth + 1});
+            }
+            c->listed.push_back({dir.path, listing.etag, listing.last_modified, std::move(listing.entries)});
+        }
+        c->cv.notify_all();
+        wake_ui();
+    }
+
+    bool finished = c->running && !c->done && c->queue.empty() && c->busy == 0;
+    if (finished) c->done = true;
+    c->cv.notify_all();
+    wake_ui();
+    if (finished && !c->failed) {
+        std::vector<CrawledDir> listed = c->listed;
+        lock.unlock();
+        ListingFormat format = LISTING_AUTO;
+        {
+            std::lock_guard<std::mutex> formats(g_listing_mx);
+            auto known = g_listing_formats.find(host);
+            if (known != g_listing_formats.end()) format = known->second;
+        }
+        save_listing_cache(c->root, c->username, format, listed);
+    }
+}
+
+void start_crawl(RemoteCrawl &c, const std::string &url, const std::string &username, const std::string &password,
+                 std::vector<CrawledDir> cached = {}) {
+    c.root = url;
+    c.username = username;
+    c.password = password;
+    for (CrawledDir &dir : cached) c.cached[dir.path] = std::move(dir);
+    if (const char* depth = getenv("COOKIE_CRAWL_DEPTH")) c.max_depth = std::max(0, atoi(depth));
+    c.queue.push_back({"", 0});
+    c.running = true;
+    for (int i = 0; i < CRAWL_WORKERS; i++) c.workers.emplace_back(crawl_worker, &c);
+}
+
+// Listings still in flight are cancelled through the generation.
+void stop_crawl(RemoteCrawl &c) {
+    {
+        std::lock_guard<std::mutex> lock(c.mx);
+        c.running = false;
+        c.generation++;
+    }
+    c.cv.notify_all();
+    net_wakeup(g_net);
+    for (std::thread &t : c.workers) t.join();
+    c.workers.clear();
+}
+
+// Hands over the changes found since the last call; false when there were none.
+bool take_crawl_entries(RemoteCrawl &c, std::vector<MusicEntry> &added, std::vector<std::string> &removed) {
+    std::lock_guard<std::mutex> lock(c.mx);
+    if (c.added.empty() && c.removed.empty()) return false;
+    added.swap(c.added);
+    removed.swap(c.removed);
+    c.added.clear();
+    c.removed.clear();
+    return true;
+}
+
+// Local counterpart of the crawler. A small pool of threads shares one
+// stack of jobs: listing a directory, or statting a batch of names found in
+// one. Large directories are split into batches so their stat calls run in
+// parallel, which is what keeps network mounts from paying one round trip
+// after another. Each directory's music files go to the UI as soon as they
+// have been resolved.
+//
+// Every listed directory is also watched with inotify. After the first scan
+// the pool stays up, and a watcher thread collects events per path until the
+// tree has been quiet for SCAN_SETTLE_MS (or SCAN_SETTLE_MAX_MS have passed),
+// then turns them into one batch of removals, re-stated files and directory
+// rescans, so copying an album in costs one merge rather than one per file.
+static const int SCAN_DEFAULT_THREADS = 4;
+static const size_t SCAN_STAT_BATCH = 128;
+static const int SCAN_SETTLE_MS = 300;
+static const int SCAN_SETTLE_MAX_MS = 2000;
+static const uint32_t SCAN_WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR;
+
+struct ScanJob {
+    std::string path;
+    int depth;
+    std::vector<std::string> names;  // empty: list the directory
+};
+
+struct LocalScan {
+    std::string root;
+    int max_depth = CRAWL_DEFAULT_DEPTH;
+    std::mutex mx;
+    std::condition_variable cv;
+    std::vector<ScanJob> jobs;
+    int busy = 0;
+    std::vector<MusicEntry> found;
+    std::vector<std::string> removed;
+    int inotify_fd = -1;
+    // Wakes the watcher for stop, and for a held flush once the workers are idle.
+    int wake_fd = -1;
+    bool flush_waiting = false;
+    std::unordered_map<int, std::string> watches;
+    std::map<std::pair<dev_t, ino_t>, std::string> visited;
+    std::vector<std::thread> workers;
+    std::thread watcher;
+    std::atomic<bool> running{false};
+    std::atomic<bool> done{false};
+    std::atomic<int> dirs_scanned{0};
+};
+
+static void scan_worker(LocalScan* scan) {
+    apply_thread_role(ROLE_ANALYSIS);
+    std::vector<MusicEntry> entries;
+    std::vector<std::string> names;
+    std::unique_lock<std::mutex> lock(scan->mx);
+    while (scan->running) {
+        if (scan->jobs.empty()) {
+            if (scan->busy == 0 && !scan->done) {
+                scan->done = true;
+                scan->cv.notify_all();
+                wake_ui();
+            }
+            if (scan->busy == 0 && scan->flush_waiting) {
+                scan->flush_waiting = false;
+                eventfd_write(scan->wake_fd, 1);
+            }
+            scan->cv.wait(lock);
+            continue;
+        }
+        ScanJob job = std::move(scan->jobs.back());
+        scan->jobs.pop_back();
+        scan->busy++;
+        lock.unlock();
+
+        std::string dirpath = join_entry(scan->root, job.path);
+        entries.clear();
+        int wd = -1;
+        if (job.names.empty()) {
+            // Symlinks can reach a directory twice, or loop back to a parent.
+            struct stat st;
+            bool seen = stat(dirpath.c_str(), &st) != 0;
+            lock.lock();
+            if (!seen) seen = !scan->visited.emplace(std::make_pair(st.st_dev, st.st_ino), job.path).second;
+            if (seen) {
+                scan->busy--;
+                scan->cv.notify_all();
+                continue;
+            }
+            lock.unlock();
+
+            // Watch before listing, so a file created in between is reported.
+            if (scan->inotify_fd >= 0) wd = inotify_add_watch(scan->inotify_fd, dirpath.c_str(), SCAN_WATCH_MASK);
+            names.clear();
+            list_local_directory(dirpath, entries, names);
+            if (!scan->done) scan->dirs_scanned++;
+            if (names.size() > SCAN_STAT_BATCH) {
+                lock.lock();
+                for (size_t i = SCAN_STAT_BATCH; i < names.size(); i += SCAN_STAT_BATCH) {
+                    size_t end = std::min(names.size(), i + SCAN_STAT_BATCH);
+                    scan->jobs.push_back({job.path, job.depth, std::vector<std::string>(names.begin() + i, names.begin() + end)});
+                }
+                scan->cv.notify_all();
+                lock.unlock();
+                names.resize(SCAN_STAT_BATCH);
+            }
+            stat_local_entries(dirpath, names, entries);
+        } else {
+            stat_local_entries(dirpath, job.names, entries);
+        }
+
+        lock.lock();
+        if (wd >= 0) scan->watches[wd] = job.path;
+        for (MusicEntry &entry : entries) {
+            entry.name = join_entry(job.path, entry.name);
+            if (!entry.dir) scan->found.push_back(std::move(entry));
+            else if (job.depth < scan->max_depth) scan->jobs.push_back({entry.name, job.depth + 1, {}});
+        }
+        if (!scan->found.empty()) wake_ui();
+        scan->busy--;
+        scan->cv.notify_all();
+    }
+}
+
+// Queues a removal for the UI, dropping any not yet collected addition it
+// covers so the two cannot be applied in the wrong order. A name ending in
+// '/' removes a subtree and "" the whole library. Called with scan->mx held.
+static void scan_remove(LocalScan* scan, const std::string &name) {
+    bool subtree = name.empty() || name.back() == '/';
+    scan->found.erase(std::remove_if(scan->found.begin(), scan->found.end(), [&](const MusicEntry &entry) {
+        return subtree ? entry.name.compare(0, name.size(), name) == 0 : entry.name == name;
+    }), scan->found.end());
+    scan->removed.push_back(name);
+}
+
+static bool path_inside(const std::string &path, const std::string &dir) {
+    return dir.empty() || (path.compare(0, dir.size(), dir) == 0 && (path.size() == dir.size() || path[dir.size()] == '/'));
+}
+
+// Forgets the watches of a directory and everything below it, and that they
+// were visited. The same directories are watched again when rescanned.
+// Called with scan->mx held.
+static void scan_unwatch(LocalScan* scan, const std::string &path) {
+    for (auto it = scan->watches.begin(); it != scan->watches.end();) {
+        if (!path_inside(it->second, path)) {
+            ++it;
+            continue;
+        }
+        inotify_rm_watch(scan->inotify_fd, it->first);
+        it = scan->watches.erase(it);
+    }
+    for (auto it = scan->visited.begin(); it != scan->visited.end();) {
+        if (path_inside(it->second, path)) it = scan->visited.erase(it);
+        else ++it;
+    }
+}
+
+static int path_depth(const std::string &path) {
+    return path.empty() ? 0 : (int)std::count(path.begin(), path.end(), '/') + 1;
+}
+
+// Applies one settled set of changed paths. A path under a directory that is
+// being rescanned in the same batch is left to that rescan. The paths are
+// stated before taking the lock, so a slow mount doesn't hold up the UI.
+static void flush_scan_changes(LocalScan* scan, std::unordered_map<std::string, bool> &pending) {
+    struct Change {
+        std::string path;
+        bool was_dir;
+        bool exists;
+        MusicEntry entry;
+    };
+    std::vector<Change> changes;
+    for (const auto &p : pending) changes.push_back({p.first, p.second, false, {}});
+    pending.clear();
+    std::sort(changes.begin(), changes.end(), [](const Change &a, const Change &b) { return a.path < b.path; });
+
+    std::vector<std::string> rescanned;
+    int rootfd = open(scan->root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (Change &change : changes) {
+        const std::string &path = change.path;
+        // Same reach as the initial scan: directories down to max_depth are
+        // listed, so files one level below them are in the library.
+        bool covered = path_depth(path) > scan->max_depth + 1;
+        for (const std::string &dir : rescanned) {
+            covered = covered || dir.empty() || (path.compare(0, dir.size(), dir) == 0 && path[dir.size()] == '/');
+        }
+        if (!covered) {
+            change.exists = rootfd >= 0 && stat_local_entry(rootfd, path.empty() ? "." : path.c_str(), change.entry);
+            bool is_dir = change.exists ? change.entry.dir : change.was_dir;
+            covered = is_dir && path_depth(path) > scan->max_depth;
+        }
+        if (covered) {
+            change.path.clear();
+            change.exists = change.was_dir = false;
+            continue;
+        }
+        if (change.exists && change.entry.dir) rescanned.push_back(path);
+    }
+    if (rootfd >= 0) close(rootfd);
+
+    std::lock_guard<std::mutex> lock(scan->mx);
+    for (Change &change : changes) {
+        const std::string &path = change.path;
+        bool is_dir = change.exists && change.entry.dir;
+        if (change.was_dir || is_dir) {
+            scan_remove(scan, path.empty() ? path : path + "/");
+            scan_unwatch(scan, path);
+        }
+        if (is_dir) {
+            scan->jobs.push_back({path, path_depth(path), {}});
+            continue;
+        }
+        if (path.empty()) continue;
+        scan_remove(scan, path);
+        if (change.exists && is_music_file(path)) {
+            change.entry.name = path;
+            scan->found.push_back(std::move(change.entry));
+        }
+    }
+    scan->cv.notify_all();
+    wake_ui();
+}
+
+static void watch_local_tree(LocalScan* scan) {
+    apply_thread_role(ROLE_ANALYSIS);
+    std::unordered_map<std::string, bool> pending;
+    alignas(struct inotify_event) char buf[16384];
+    std::chrono::steady_clock::time_point first, last;
+    bool held = false;
+    while (scan->running) {
+        // Without pending changes, or while they wait on the workers, only an fd wakes us.
+        int timeout = -1;
+        if (!pending.empty() && !held) {
+            auto now = std::chrono::steady_clock::now();
+            auto due = std::min(last + std::chrono::milliseconds(SCAN_SETTLE_MS), first + std::chrono::milliseconds(SCAN_SETTLE_MAX_MS));
+            timeout = due > now ? (int)std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1 : 0;
+        }
+        struct pollfd pfds[2] = {{scan->inotify_fd, POLLIN, 0}, {scan->wake_fd, POLLIN, 0}};
+        if (poll(pfds, 2, timeout) <= 0) pfds[0].revents = pfds[1].revents = 0;
+        if (pfds[1].revents & POLLIN) {
+            eventfd_t count;
+            eventfd_read(scan->wake_fd, &count);
+            held = false;
+        }
+        if (pfds[0].revents & POLLIN) {
+            bool was_empty = pending.empty();
+            ssize_t len;
+            std::lock_guard<std::mutex> lock(scan->mx);
+            while ((len = read(scan->inotify_fd, buf, sizeof(buf))) > 0) {
+                for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+                    const struct inotify_event* ev = (const struct inotify_event*)p;
+                    if (ev->mask & IN_Q_OVERFLOW) {
+                        pending[""] = true;
+                        continue;
+                    }
+                    auto it = scan->watches.find(ev->wd);
+                    if (it == scan->watches.end()) continue;
+                    if (ev->mask & IN_IGNORED) {
+                        scan->watches.erase(it);
+                        continue;
+                    }
+                    if (ev->len == 0) continue;
+                    bool &is_dir = pending[join_entry(it->second, ev->name)];
+                    is_dir = is_dir || (ev->mask & IN_ISDIR);
+                }
+            }
+            last = std::chrono::steady_clock::now();
+            if (was_empty) first = last;
+        }
+        if (pending.empty()) continue;
+        auto now = std::chrono::steady_clock::now();
+        if (now - last < std::chrono::milliseconds(SCAN_SETTLE_MS) && now - first < std::chrono::milliseconds(SCAN_SETTLE_MAX_MS)) continue;
+        {
+            // Changes wait for running scans, whose results they may overlap.
+            std::lock_guard<std::mutex> lock(scan->mx);
+            if (!scan->done || scan->busy || !scan->jobs.empty()) {
+                scan->flush_waiting = held = true;
+                continue;
+            }
+        }
+        flush_scan_changes(scan, pending);
+    }
+}
+
+void start_local_scan(LocalScan &scan, const std::string &root) {
+    scan.root = root;
+    if (const char* depth = getenv("COOKIE_CRAWL_DEPTH")) scan.max_depth = std::max(0, atoi(depth));
+    int threads = SCAN_DEFAULT_THREADS;
+    if (const char* n = getenv("COOKIE_SCAN_THREADS")) threads = std::max(1, atoi(n));
+    scan.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    scan.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    scan.jobs.push_back({"", 0, {}});
+    scan.running = true;
+    for (int i = 0; i < threads; i++) scan.workers.emplace_back(scan_worker, &scan);
+    if (scan.inotify_fd >= 0 && scan.wake_fd >= 0) scan.watcher = std::thread(watch_local_tree, &scan);
+}
+
+void stop_local_scan(LocalScan &scan) {
+    {
+        std::lock_guard<std::mutex> lock(scan.mx);
+        scan.running = false;
+    }
+    scan.cv.notify_all();
+    if (scan.wake_fd >= 0) eventfd_write(scan.wake_fd, 1);
+    for (std::thread &t : scan.workers) t.join();
+    scan.workers.clear();
+    if (scan.watcher.joinable()) scan.watcher.join();
+    if (scan.inotify_fd >= 0) close(scan.inotify_fd);
+    if (scan.wake_fd >= 0) close(scan.wake_fd);
+    scan.inotify_fd = scan.wake_fd = -1;
+}
+
+bool take_scan_entries(LocalScan &scan, std::vector<MusicEntry> &added, std::vector<std::string> &removed) {
+    std::lock_guard<std::mutex> lock(scan.mx);
+    if (scan.found.empty() && scan.removed.empty()) return false;
+    added.swap(scan.found);
+    removed.swap(scan.removed);
+    scan.found.clear();
+    scan.removed.clear();
+    return true;
+}
+
+struct StreamReader {
+    std::shared_ptr<NetRequest> request;
+    std::shared_ptr<RemoteStream> stream;
+    size_t offset = 0;
+    std::atomic<bool>* stalled = nullptr;
+};
+
+// Called with the stream locked when the reader wants bytes the window has
+// already given up, or ones too far ahead to wait for: the transfer is
+// replaced by a Range request starting at the reader.
+static void stream_refetch(StreamReader &reader, uint64_t offset) {
+    RemoteStream &stream = *reader.stream;
+    std::shared_ptr<NetRequest> old = reader.request;
+    auto req = make_net_request(NET_RANGE, old->url, old->username, old->password);
+    req->stream = reader.stream;
+    req->stream_epoch = ++stream.epoch;
+    req->range_start = (curl_off_t)offset;
+    req->priority = old->priority.load();
+    req->cancel_generation = old->cancel_generation.load();
+    req->cancel_latest.store(old->cancel_latest.load());
+
+    if (stream.segmented) {
+        for (const StreamSegment &seg : stream.segments) {
+            if (seg.request != old->id) net_cancel(g_net, seg.request);
+        }
+        stream.segments.clear();
+        stream.next_segment = offset;
+        req->segment = true;
+        req->range_end = (curl_off_t)(offset + NET_SEGMENT_BYTES - 1);
+    }
+    stream.start = stream.end = stream.read_pos = offset;
+    stream.writer_blocked = false;
+    stream.done = false;
+    stream.failed = false;
+    net_cancel(g_net, old->id);
+    net_submit(g_net, req);
+    reader.request = req;
+    g_net.refetches++;
+}
+
+static ma_result stream_read_bytes(StreamReader* reader, void* pBuffer, size_t bytesToRead, size_t* bytesRead) {
+    RemoteStream &stream = *reader->stream;
+    std::unique_lock<std::mutex> lock(stream.mx);
+    uint64_t offset = reader->offset;
+    uint64_t end = offset + bytesToRead;
+    if (stream.content_length >= 0) end = std::min<uint64_t>(end, stream.content_length);
+    if (!stream.closed && stream.capacity > 0 &&
+        (offset < stream.start || offset > stream.end + stream.capacity)) {
+        stream_refetch(*reader, offset);
+    }
+    stream.read_pos = offset;
+    if (stream.end < end && !stream.done && !stream.closed) {
+        if (reader->stalled) *reader->stalled = true;
+        // A seek moves the floor, so a paused writer may have room now.
+        if (stream.writer_blocked && stream_resumable(stream)) net_wakeup(g_net);
+        stream.cv.wait(lock, [&] { return stream.end >= end || stream.done || stream.closed; });
+        if (reader->stalled) *reader->stalled = false;
+    }
+    if (stream.closed || offset < stream.start) {
+        *bytesRead = 0;
+        return MA_AT_END;
+    }
+
+    size_t copied = offset < stream.end ? (size_t)(std::min(end, stream.end) - offset) : 0;
+    stream_copy_out(stream, offset, (char*)pBuffer, copied);
+    reader->offset += copied;
+    stream.read_pos = reader->offset;
+    bool wake = stream.writer_blocked && stream_resumable(stream);
+    lock.unlock();
+
+    if (wake) net_wakeup(g_net);
+    *bytesRead = copied;
+    return copied == 0 ? MA_AT_END : MA_SUCCESS;
+}
+
+static ma_result stream_read(ma_decoder* pDecoder, void* pBuffer, size_t bytesToRead, size_t* bytesRead) {
+    return stream_read_bytes((StreamReader*)pDecoder->pUserData, pBuffer, bytesToRead, bytesRead);
+}
+
+static ma_result stream_seek(ma_decoder* pDecoder, ma_int64 offset, ma_seek_origin origin) {
+    StreamReader* reader = (StreamReader*)pDecoder->pUserData;
+    RemoteStream &stream = *reader->stream;
+    std::unique_lock<std::mutex> lock(stream.mx);
+    int64_t newOffset = offset;
+
+    if (origin == ma_seek_origin_current) {
+        newOffset += (int64_t)reader->offset;
+    } else if (origin == ma_seek_origin_end) {
+        if (stream.content_length < 0) stream.cv.wait(lock, [&] { return stream.done || stream.closed; });
+        newOffset += stream.content_length >= 0 ? (int64_t)stream.content_length : (int64_t)stream.end;
+    }
+
+    if (newOffset < 0 || (stream.content_length >= 0 && newOffset > (int64_t)stream.content_length)) return MA_INVALID_ARGS;
+
+    reader->offset = (size_t)newOffset;
+    return MA_SUCCESS;
+}
+
+bool stream_complete(RemoteStream &stream) {
+    std::lock_guard<std::mutex> lock(stream.mx);
+    return stream.done && !stream.failed;
+}
+
+bool stream_failed(RemoteStream &stream) {
+    std::lock_guard<std::mutex> lock(stream.mx);
+    return stream.failed;
+}
+
+void close_stream(RemoteStream &stream) {
+    std::lock_guard<std::mutex> lock(stream.mx);
+    stream.closed = true;
+    stream.cv.notify_all();
+}
+
+// Local tracks are read through a plain fd rather than ma_decoder_init_file,
+// so the engine knows where the decoder is reading. The next readahead bytes
+// past that point are requested with posix_fadvise(WILLNEED), topped up every
+// half window, which lets NFS and SMB mounts fetch ahead of the decoder
+// instead of on demand. mincore on the file's mapping tells whether the pages
+// of a read are already cached, which gives the hit and miss counts; one call
+// covers up to 1 MiB, and reads inside the resident run it found are hits.
+//
+// Reads copy straight out of that mapping (COOKIE_LOCAL_IO=read switches to
+// pread). A file truncated under the mapping raises SIGBUS on the copy; the
+// handler jumps back out of it and the track ends where the data did.
+static const int64_t LOCAL_READAHEAD_DEFAULT = 4 << 20;
+static const int64_t LOCAL_PREFETCH_BYTES = 2 << 20;
+static const int LOCAL_PREFETCH_TRACKS = 2;
+
+struct LocalReader {
+    int fd = -1;
+    int64_t offset = 0;
+    int64_t size = 0;
+    int64_t advised = 0;
+    int64_t readahead = LOCAL_READAHEAD_DEFAULT;
+    int64_t resident_start = 0;
+    int64_t resident_end = 0;
+    void* map = nullptr;
+    bool map_reads = false;
+    bool truncated = false;
+    std::atomic<ma_uint64>* hits = nullptr;
+    std::atomic<ma_uint64>* misses = nullptr;
+};
+
+static int64_t local_readahead_bytes() {
+    static const int64_t bytes = [] {
+        const char* kib = getenv("COOKIE_READAHEAD");
+        return kib ? std::max(0LL, atoll(kib)) * 1024 : LOCAL_READAHEAD_DEFAULT;
+    }();
+    return bytes;
+}
+
+static bool local_map_reads() {
+    static const bool mmap_reads = [] {
+        const char* io = getenv("COOKIE_LOCAL_IO");
+        return !io || strcmp(io, "read") != 0;
+    }();
+    return mmap_reads;
+}
+
+static thread_local sigjmp_buf* volatile t_sigbus_jump = nullptr;
+
+static void sigbus_handler(int sig, siginfo_t*, void*) {
+    if (t_sigbus_jump) siglongjmp(*t_sigbus_jump, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void install_sigbus_handler() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        struct sigaction sa = {};
+        sa.sa_sigaction = sigbus_handler;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, nullptr);
+    });
+}
+
+// memcpy from a file mapping that reports a SIGBUS instead of dying of it.
+// The handler runs with SA_NODEFER and an empty sa_mask, so the mask needs no
+// restoring on the way out, and saving it would cost a syscall per read.
+static bool mapped_copy(void* dst, const void* src, size_t length) {
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 0)) {
+        t_sigbus_jump = nullptr;
+        return false;
+    }
+    t_sigbus_jump = &jump;
+    memcpy(dst, src, length);
+    t_sigbus_jump = nullptr;
+    return true;
+}
+
+bool local_open(LocalReader &reader, const std::string &path, bool map_reads) {
+    reader.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (reader.fd < 0) return false;
+    struct stat st;
+    if (fstat(reader.fd, &st) != 0) {
+        close(reader.fd);
+        reader.fd = -1;
+        return false;
+    }
+    reader.size = st.st_size;
+    reader.offset = 0;
+    reader.advised = 0;
+    reader.readahead = local_readahead_bytes();
+    if (reader.readahead > 0) posix_fadvise(reader.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    reader.map = reader.size > 0 ? mmap(nullptr, reader.size, PROT_READ, MAP_SHARED, reader.fd, 0) : nullptr;
+    if (reader.map == MAP_FAILED) reader.map = nullptr;
+    reader.map_reads = map_reads && reader.map;
+    reader.truncated = false;
+    reader.resident_start = reader.resident_end = 0;
+    if (reader.map_reads) {
+        install_sigbus_handler();
+        madvise(reader.map, reader.size, MADV_SEQUENTIAL);
+        // Only takes effect where the kernel can back file pages with huge
+        // pages; elsewhere it fails harmlessly.
+        if (reader.size >= (2 << 20)) madvise(reader.map, reader.size, MADV_HUGEPAGE);
+    }
+    return true;
+}
+
+void local_close(LocalReader &reader) {
+    if (reader.map) munmap(reader.map, reader.size);
+    reader.map = nullptr;
+    if (reader.fd >= 0) close(reader.fd);
+    reader.fd = -1;
+}
+
+// End of the run of cached pages starting at offset, looking no further than limit.
+static int64_t local_resident_end(const LocalReader &reader, int64_t offset, int64_t limit) {
+    static const int64_t page = sysconf(_SC_PAGESIZE);
+    unsigned char resident[256];
+    int64_t at = offset / page * page;
+    size_t pages = (size_t)std::min<int64_t>(256, (limit - at + page - 1) / page);
+    if (mincore((char*)reader.map + at, pages * page, resident) != 0) return offset;
+    for (size_t i = 0; i < pages; i++, at += page) {
+        if (!(resident[i] & 1)) return std::max(offset, at);
+    }
+    return std::min(limit, at);
+}
+
+// Starts reading the head of a track the queue is likely to reach next.
+void local_prefetch(const std::string &path) {
+    int64_t bytes = std::min(local_readahead_bytes(), LOCAL_PREFETCH_BYTES);
+    if (bytes == 0) return;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, bytes, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+static void local_advise(LocalReader &reader, size_t bytesToRead) {
+    if (reader.readahead == 0) return;
+    int64_t want = reader.offset + (int64_t)bytesToRead;
+    if (reader.offset < reader.advised - reader.readahead || reader.offset > reader.advised) reader.advised = reader.offset;
+    if (want + reader.readahead / 2 <= reader.advised || reader.advised >= reader.size) return;
+    int64_t end = std::min(reader.size, std::max(want, reader.offset + reader.readahead));
+    posix_fadvise(reader.fd, reader.advised, end - reader.advised, POSIX_FADV_WILLNEED);
+    reader.advised = end;
+}
+
+static ma_result local_read(ma_decoder* pDecoder, void* pBuffer, size_t bytesToRead, size_t* bytesRead) {
+    LocalReader &reader = *(LocalReader*)pDecoder->pUserData;
+    size_t want = (size_t)std::max<int64_t>(0, std::min<int64_t>(bytesToRead, reader.size - reader.offset));
+    if (reader.map && want > 0) {
+        int64_t end = reader.offset + (int64_t)want;
+        if (reader.offset < reader.resident_start || end > reader.resident_end) {
+            reader.resident_start = reader.offset;
+            reader.resident_end = local_resident_end(reader, reader.offset, std::min(reader.size, std::max(end, reader.offset + (1 << 20))));
+        }
+        if (end <= reader.resident_end) (*reader.hits)++;
+        else (*reader.misses)++;
+    }
+    local_advise(reader, bytesToRead);
+    size_t got = 0;
+    if (reader.truncated) want = 0;
+    if (reader.map_reads && want > 0) {
+        if (mapped_copy(pBuffer, (const char*)reader.map + reader.offset, want)) got = want;
+        else reader.truncated = true;
+        want = got;
+    }
+    while (got < want) {
+        ssize_t n = pread(reader.fd, (char*)pBuffer + got, want - got, reader.offset + got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    reader.offset += got;
+    *bytesRead = got;
+    return got == 0 ? MA_AT_END : MA_SUCCESS;
+}
+
+size_t local_peek(const LocalReader &reader, unsigned char* head, size_t length) {
+    ssize_t n = pread(reader.fd, head, length, 0);
+    return n > 0 ? (size_t)n : 0;
+}
+
+static ma_result local_seek(ma_decoder* pDecoder, ma_int64 offset, ma_seek_origin origin) {
+    LocalReader &reader = *(LocalReader*)pDecoder->pUserData;
+    int64_t newOffset = offset;
+    if (origin == ma_seek_origin_current) newOffset += reader.offset;
+    else if (origin == ma_seek_origin_end) newOffset += reader.size;
+    if (newOffset < 0 || newOffset > reader.size) return MA_INVALID_ARGS;
+    reader.offset = newOffset;
+    return MA_SUCCESS;
+}
+
+static const size_t AUDIO_ARENA_SIZE = 8u << 20;
+static const size_t ARENA_HEADER_SIZE = 16;
+static const uint32_t ARENA_CLASS_COUNT = 18;
+static const uint32_t ARENA_FALLBACK = 0xFFFFFFFFu;
+
+struct AudioArena {
+    char* base = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    bool locked = false;
+    void* free_lists[ARENA_CLASS_COUNT] = {};
+    std::mutex mx;
+    std::atomic<size_t> fallback_allocs{0};
+};
+
+static AudioArena g_audio_arena;
+
+bool prefault_and_lock(void* p, size_t n) {
+    long page = sysconf(_SC_PAGESIZE);
+    volatile char* bytes = (volatile char*)p;
+    for (size_t off = 0; off < n; off += page) bytes[off] = bytes[off];
+    return mlock(p, n) == 0;
+}
+
+bool init_audio_arena(AudioArena &a, size_t capacity) {
+    void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (p == MAP_FAILED) return false;
+    a.base = (char*)p;
+    a.capacity = capacity;
+    a.locked = prefault_and_lock(p, capacity);
+    return true;
+}
+
+static size_t arena_class_size(uint32_t cls) {
+    return (size_t)64 << cls;
+}
+
+static void* arena_malloc(size_t sz, void* user) {
+    AudioArena* a = (AudioArena*)user;
+    uint32_t cls = 0;
+    while (cls < ARENA_CLASS_COUNT && arena_class_size(cls) < sz) cls++;
+
+    char* block = nullptr;
+    if (a->base && cls < ARENA_CLASS_COUNT) {
+        std::lock_guard<std::mutex> lock(a->mx);
+        if (a->free_lists[cls]) {
+            block = (char*)a->free_lists[cls];
+            a->free_lists[cls] = *(void**)block;
+        } else if (a->used + ARENA_HEADER_SIZE + arena_class_size(cls) <= a->capacity) {
+            block = a->base + a->used;
+            a->used += ARENA_HEADER_SIZE + arena_class_size(cls);
+        }
+    }
+
+    if (!block) {
+        a->fallback_allocs++;
+        block = (char*)malloc(ARENA_HEADER_SIZE + sz);
+        if (!block) return nullptr;
+        cls = ARENA_FALLBACK;
+    }
+
+    ((uint32_t*)block)[0] = cls;
+    *(uint64_t*)(block + 8) = sz;
+    return block + ARENA_HEADER_SIZE;
+}
+
+static void arena_free(void* p, void* user) {
+    if (!p) return;
+    AudioArena* a = (AudioArena*)user;
+    char* block = (char*)p - ARENA_HEADER_SIZE;
+    uint32_t cls = ((uint32_t*)block)[0];
+    if (cls == ARENA_FALLBACK) {
+        free(block);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(a->mx);
+    *(void**)block = a->free_lists[cls];
+    a->free_lists[cls] = block;
+}
+
+static void* arena_realloc(void* p, size_t sz, void* user) {
+    if (!p) return arena_malloc(sz, user);
+    char* block = (char*)p - ARENA_HEADER_SIZE;
+    uint32_t cls = ((uint32_t*)block)[0];
+    size_t old_size = *(uint64_t*)(block + 8);
+    if (cls != ARENA_FALLBACK && sz <= arena_class_size(cls)) {
+        *(uint64_t*)(block + 8) = sz;
+        return p;
+    }
+    void* np = arena_malloc(sz, user);
+    if (!np) return nullptr;
+    memcpy(np, p, std::min(old_size, sz));
+    arena_free(p, user);
+    return np;
+}
+
+ma_allocation_callbacks audio_arena_callbacks() {
+    ma_allocation_callbacks cb{};
+    cb.pUserData = &g_audio_arena;
+    cb.onMalloc = arena_malloc;
+    cb.onRealloc = arena_realloc;
+    cb.onFree = arena_free;
+    return cb;
+}
+
+// An initialized decoder together with the source it reads. Slots live on the
+// heap and never move: miniaudio's backends point back at the decoder, and the
+// decoder at the reader. heap_bytes counts what the decoder allocated, which
+// is what a warm slot is charged against the pool's budget.
+struct DecoderSlot {
+    ma_decoder decoder{};
+    bool ready = false;
+    std::string path;
+    bool remote = false;
+    StreamReader reader;
+    LocalReader local;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    int64_t mtime = 0;
+    bool length_known = false;
+    ma_uint64 length = 0;
+    std::atomic<size_t> heap_bytes{0};
+
+    ~DecoderSlot() {
+        if (ready) ma_decoder_uninit(&decoder);
+        local_close(local);
+        if (reader.request) net_cancel(g_net, reader.request->id);
+    }
+};
+
+static size_t arena_block_bytes(void* p) {
+    return p ? (size_t)*(uint64_t*)((char*)p - ARENA_HEADER_SIZE + 8) : 0;
+}
+
+static void* slot_malloc(size_t sz, void* user) {
+    void* p = arena_malloc(sz, &g_audio_arena);
+    if (p) ((DecoderSlot*)user)->heap_bytes += sz;
+    return p;
+}
+
+static void* slot_realloc(void* p, size_t sz, void* user) {
+    size_t old = arena_block_bytes(p);
+    void* np = arena_realloc(p, sz, &g_audio_arena);
+    if (np) ((DecoderSlot*)user)->heap_bytes += sz - old;
+    return np;
+}
+
+static void slot_free(void* p, void* user) {
+    ((DecoderSlot*)user)->heap_bytes -= arena_block_bytes(p);
+    arena_free(p, &g_audio_arena);
+}
+
+ma_allocation_callbacks slot_callbacks(DecoderSlot* slot) {
+    ma_allocation_callbacks cb{};
+    cb.pUserData = slot;
+    cb.onMalloc = slot_malloc;
+    cb.onRealloc = slot_realloc;
+    cb.onFree = slot_free;
+    return cb;
+}
+
+static size_t slot_bytes(const DecoderSlot &slot) {
+    return sizeof(DecoderSlot) + slot.heap_bytes;
+}
+
+// Recently played local tracks and the highlighted row keep an initialized
+// decoder, rewound to the first frame, so starting one again is a pointer
+// swap instead of an open, a format probe and (for MP3) a length scan. Least
+// recently used slots go first once COOKIE_DECODER_POOL KiB are exceeded.
+// Remote tracks are left out: a parked decoder would pin a connection and its
+// window, and the stream prefetch already covers the next track. The engine
+// parks and takes slots; the warm worker opens highlighted rows off the
+// engine thread and parks them too, so the list is guarded by mx.
+static const size_t DECODER_POOL_DEFAULT = 2u << 20;
+static const auto WARM_DWELL = std::chrono::milliseconds(250);
+
+struct DecoderPool {
+    std::mutex mx;
+    std::vector<std::unique_ptr<DecoderSlot>> slots;
+    size_t budget = DECODER_POOL_DEFAULT;
+    std::atomic<size_t> bytes{0};
+    std::atomic<size_t> count{0};
+    std::atomic<ma_uint64> hits{0};
+    std::atomic<ma_uint64> misses{0};
+    std::atomic<ma_uint64> warms{0};
+    std::atomic<int64_t> warm_total_us{0};
+    std::atomic<ma_uint64> warm_reads{0};
+};
+
+static size_t decoder_pool_budget() {
+    const char* kib = getenv("COOKIE_DECODER_POOL");
+    return kib ? (size_t)std::max(0LL, atoll(kib)) * 1024 : DECODER_POOL_DEFAULT;
+}
+
+static void pool_update(DecoderPool &pool) {
+    size_t bytes = 0;
+    for (const auto &slot : pool.slots) bytes += slot_bytes(*slot);
+    pool.bytes = bytes;
+    pool.count = pool.slots.size();
+}
+
+// A slot whose file has since been replaced or rewritten is dropped.
+static bool slot_current(const DecoderSlot &slot) {
+    struct stat st;
+    return stat(slot.path.c_str(), &st) == 0 && st.st_dev == slot.dev && st.st_ino == slot.ino &&
+           st.st_size == slot.local.size && st.st_mtime == slot.mtime;
+}
+
+std::unique_ptr<DecoderSlot> pool_take(DecoderPool &pool, const std::string &path) {
+    std::unique_ptr<DecoderSlot> slot;
+    {
+        std::lock_guard<std::mutex> lock(pool.mx);
+        for (size_t i = 0; i < pool.slots.size() && !slot; i++) {
+            if (pool.slots[i]->path != path) continue;
+            slot = std::move(pool.slots[i]);
+            pool.slots.erase(pool.slots.begin() + i);
+            pool_update(pool);
+        }
+    }
+    if (slot && !slot_current(*slot)) slot.reset();
+    return slot;
+}
+
+bool pool_touch(DecoderPool &pool, const std::string &path) {
+    std::lock_guard<std::mutex> lock(pool.mx);
+    for (size_t i = 0; i < pool.slots.size(); i++) {
+        if (pool.slots[i]->path != path) continue;
+        std::rotate(pool.slots.begin() + i, pool.slots.begin() + i + 1, pool.slots.end());
+        return true;
+    }
+    return false;
+}
+
+// Evicted slots are closed after the lock is dropped.
+void pool_park(DecoderPool &pool, std::unique_ptr<DecoderSlot> slot) {
+    if (!slot || !slot->ready || slot->remote || slot_bytes(*slot) > pool.budget) return;
+    if (ma_decoder_seek_to_pcm_frame(&slot->decoder, 0) != MA_SUCCESS) return;
+    std::vector<std::unique_ptr<DecoderSlot>> evicted;
+    std::lock_guard<std::mutex> lock(pool.mx);
+    for (size_t i = 0; i < pool.slots.size(); i++) {
+        if (pool.slots[i]->path != slot->path) continue;
+        evicted.push_back(std::move(pool.slots[i]));
+        pool.slots.erase(pool.slots.begin() + i);
+        break;
+    }
+    pool.slots.push_back(std::move(slot));
+    pool_update(pool);
+    while (pool.bytes > pool.budget) {
+        evicted.push_back(std::move(pool.slots.front()));
+        pool.slots.erase(pool.slots.begin());
+        pool_update(pool);
+    }
+}
+
+void pool_clear(DecoderPool &pool) {
+    std::lock_guard<std::mutex> lock(pool.mx);
+    pool.slots.clear();
+    pool_update(pool);
+}
+
+static const ma_uint32 RING_CAPACITY_MS = 4000;
+static const ma_uint32 DECODE_CHUNK_FRAMES = 1024;
+
+struct LatencyLevel {
+    ma_uint32 periodFrames;
+    ma_uint32 periods;
+    ma_uint32 aheadMs;
+};
+
+// Level 0 keeps miniaudio's low-latency defaults; each step trades latency for headroom.
+static const LatencyLevel LATENCY_LADDER[] = {
+    {0, 0, 100},
+    {512, 3, 150},
+    {1024, 3, 250},
+    {2048, 4, 500},
+    {4096, 4, 1000},
+};
+static const int LATENCY_LEVELS = sizeof(LATENCY_LADDER) / sizeof(LATENCY_LADDER[0]);
+static const int UNDERRUNS_TO_GROW = 2;
+static const auto UNDERRUN_WINDOW = std::chrono::seconds(5);
+static const auto STABLE_TO_SHRINK = std::chrono::seconds(30);
+static const auto PAUSE_SUSPEND_GRACE = std::chrono::seconds(2);
+
+enum PowerProfile { PROFILE_INTERACTIVE, PROFILE_CONSERVATIVE };
+
+static const char* POWER_PROFILE_NAMES[] = {"interactive", "conservative"};
+static const ma_uint32 CONSERVATIVE_PERIOD_MS = 200;
+static const ma_uint32 CONSERVATIVE_PERIODS = 3;
+static const ma_uint32 CONSERVATIVE_AHEAD_MS = 3500;
+static const ma_uint32 CONSERVATIVE_REFILL_MS = 1000;
+static const auto IDLE_TO_CONSERVATIVE = std::chrono::seconds(60);
+
+static const double WATERMARK_MIN_SECONDS = 0.5;
+static const double WATERMARK_DEFAULT_SECONDS = 2.0;
+static const auto THROUGHPUT_SAMPLE_TIME = std::chrono::milliseconds(200);
+
+enum EngineCommandType { CMD_PLAY, CMD_PREFETCH, CMD_WARM, CMD_TOGGLE_PAUSE, CMD_STOP, CMD_SET_PROFILE, CMD_QUIT };
+
+struct EngineCommand {
+    EngineCommandType type = CMD_STOP;
+    uint64_t generation = 0;
+    std::string path;
+    bool remote = false;
+    int64_t size = -1;
+    std::string username;
+    std::string password;
+    int profile = 0;
+};
+
+enum EngineEventType { EVT_STARTED, EVT_FAILED, EVT_TRACK_FINISHED };
+
+struct EngineEvent {
+    EngineEventType type = EVT_FAILED;
+    uint64_t generation = 0;
+    std::string path;
+};
+
+static const size_t ENGINE_QUEUE_SIZE = 64;
+
+struct PlaybackSnapshot {
+    ma_uint64 file_id;
+    bool playing;
+    bool paused;
+    bool suspended;
+    ma_uint32 sample_rate;
+    ma_uint64 length;
+    ma_uint64 position;
+    ma_uint32 period_frames;
+    ma_uint32 periods;
+    char file_name[256];
+};
+
+// Seqlock: the engine publishes under its own mutex, readers retry instead of locking.
+struct SnapshotSlot {
+    std::atomic<ma_uint32> seq{0};
+    PlaybackSnapshot data{};
+};
+
+void publish_snapshot(SnapshotSlot &slot, const PlaybackSnapshot &snap) {
+    ma_uint32 seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&slot.data, &snap, sizeof(snap));
+    slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+PlaybackSnapshot read_snapshot(const SnapshotSlot &slot) {
+    PlaybackSnapshot out;
+    ma_uint32 before, after;
+    do {
+        before = slot.seq.load(std::memory_order_acquire);
+        memcpy(&out, &slot.data, sizeof(out));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = slot.seq.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return out;
+}
+
+struct PlaybackState {
+    ma_context context{};
+    bool context_ready = false;
+    std::unique_ptr<DecoderSlot> track;
+    DecoderPool pool;
+    ma_device device{};
+    std::atomic<bool> playing{false};
+    std::atomic<bool> stop_requested{false};
+    std::mutex mx;
+    std::atomic<ma_uint64> current_frame{0};
+    std::atomic<ma_uint64> total_frames{0};
+    std::string current_file;
+    std::atomic<bool> paused{false};
+
+    ma_pcm_rb ring{};
+    void* ring_storage = nullptr;
+    std::thread decode_thread;
+    std::atomic<bool> decode_stop{false};
+    std::atomic<bool> decoder_eof{false};
+    std::atomic<bool> drained{false};
+    std::atomic<pid_t> audio_tid{0};
+    pid_t audio_role_tid = 0;
+    std::atomic<ma_uint32> ahead_frames{0};
+    std::atomic<ma_uint32> refill_frames{0};
+    std::atomic<int> profile{PROFILE_INTERACTIVE};
+
+    std::atomic<int> latency_level{0};
+    std::atomic<ma_uint64> underruns{0};
+    std::atomic<ma_uint64> late_callbacks{0};
+    std::atomic<int64_t> last_callback_ns{0};
+
+    std::atomic<bool> suspended{false};
+    std::chrono::steady_clock::time_point paused_at;
+
+    ma_uint64 file_id = 0;
+    SnapshotSlot snapshot;
+
+    MpscRing<EngineCommand, ENGINE_QUEUE_SIZE> commands;
+    MpscRing<EngineEvent, ENGINE_QUEUE_SIZE> events;
+    sem_t command_sem;
+    std::atomic<uint64_t> load_generation{0};
+    uint64_t active_generation = 0;
+    std::thread engine_thread;
+    std::thread monitor_thread;
+
+    std::string prefetch_url;
+    std::shared_ptr<NetRequest> prefetch;
+    std::mutex wake_mx;
+    std::condition_variable wake_cv;
+
+    std::atomic<bool> network_stall{false};
+    std::atomic<bool> length_exact{true};
+    std::atomic<int> watermark_ms{0};
+
+    std::atomic<int64_t> start_ns{0};
+    std::atomic<bool> ttfa_pending{false};
+    std::atomic<bool> ttfa_remote{false};
+    std::atomic<int64_t> last_ttfa_ms{0};
+    std::atomic<int64_t> ttfa_total_ms[2] = {};
+    std::atomic<ma_uint64> ttfa_starts[2] = {};
+
+    std::atomic<int64_t> last_init_us{0};
+    std::atomic<int64_t> init_total_us{0};
+    std::atomic<ma_uint64> inits{0};
+    std::atomic<ma_uint64> init_fallbacks{0};
+    std::atomic<int> last_format{ma_encoding_format_unknown};
+
+    std::atomic<ma_uint64> local_hits{0};
+    std::atomic<ma_uint64> local_misses{0};
+
+    std::thread warm_thread;
+    std::mutex warm_mx;
+    std::condition_variable warm_cv;
+    std::string warm_next;
+    // Local files to read ahead, newest last; opening one can block on a network mount.
+    std::deque<std::string> prefetch_next;
+    bool warm_quit = false;
+};
+
+int64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount) {
+    auto* state = (PlaybackState*)pDevice->pUserData;
+    size_t bytesPerFrame = ma_get_bytes_per_frame(pDevice->playback.format, pDevice->playback.channels);
+    if (!state || state->paused) {
+        memset(pOutput, 0, frameCount * bytesPerFrame);
+        if (state) state->last_callback_ns = 0;
+        return;
+    }
+
+#ifdef COOKIE_RT_DEBUG
+    t_in_audio_callback = true;
+#endif
+
+    // The monitor thread applies the audio role once it sees the thread id.
+    if (!state->audio_tid) state->audio_tid = (pid_t)syscall(SYS_gettid);
+
+    int64_t now = steady_ns();
+    int64_t last = state->last_callback_ns.exchange(now);
+    int64_t period_ns = (int64_t)frameCount * 1000000000 / pDevice->sampleRate;
+    if (last != 0 && now - last > 2 * period_ns + 5000000) state->late_callbacks++;
+
+    ma_uint32 framesRead = 0;
+    while (framesRead < frameCount) {
+        ma_uint32 chunk = frameCount - framesRead;
+        void* src;
+        if (ma_pcm_rb_acquire_read(&state->ring, &chunk, &src) != MA_SUCCESS || chunk == 0) break;
+        memcpy((char*)pOutput + framesRead * bytesPerFrame, src, chunk * bytesPerFrame);
+        ma_pcm_rb_commit_read(&state->ring, chunk);
+        framesRead += chunk;
+    }
+
+    state->current_frame += framesRead;
+    if (framesRead > 0 && state->ttfa_pending) {
+        state->ttfa_pending = false;
+        int64_t ms = (now - state->start_ns) / 1000000;
+        state->last_ttfa_ms = ms;
+        state->ttfa_total_ms[state->ttfa_remote] += ms;
+        state->ttfa_starts[state->ttfa_remote]++;
+    }
+
+    if (framesRead < frameCount) {
+        memset((char*)pOutput + framesRead * bytesPerFrame, 0, (frameCount - framesRead) * bytesPerFrame);
+        if (state->decoder_eof) state->drained = true;
+        else if (!state->network_stall) state->underruns++;
+    }
+
+#ifdef COOKIE_RT_DEBUG
+    t_in_audio_callback = false;
+#endif
+}
+
+void decode_loop(PlaybackState* s) {
+    apply_thread_role(ROLE_DECODER);
+
+    while (!s->decode_stop) {
+        ma_uint32 target = s->ahead_frames;
+        ma_uint32 refill = s->refill_frames;
+        ma_uint32 buffered = ma_pcm_rb_available_read(&s->ring);
+        if (buffered > refill) {
+            if (s->suspended) {
+                std::unique_lock<std::mutex> lock(s->wake_mx);
+                s->wake_cv.wait(lock, [s] { return !s->suspended || s->decode_stop; });
+                continue;
+            }
+            ma_uint32 drainMs = (buffered - refill) * 1000 / s->track->decoder.outputSampleRate;
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::max<ma_uint32>(1, drainMs)));
+            continue;
+        }
+
+        while (buffered < target && !s->decode_stop) {
+            ma_uint32 chunk = target - buffered;
+            void* dst;
+            if (ma_pcm_rb_acquire_write(&s->ring, &chunk, &dst) != MA_SUCCESS || chunk == 0) break;
+            ma_uint64 framesRead = 0;
+            ma_result result = ma_decoder_read_pcm_frames(&s->track->decoder, dst, chunk, &framesRead);
+            ma_pcm_rb_commit_write(&s->ring, (ma_uint32)framesRead);
+            if (result != MA_SUCCESS || framesRead < chunk) {
+                s->decoder_eof = true;
+                return;
+            }
+            buffered = ma_pcm_rb_available_read(&s->ring);
+        }
+    }
+}
 
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        curl_easy_cleanup(curl);
-        return files;
+// Called with s.mx held whenever anything the UI displays changes.
+void publish_playback(PlaybackState &s) {
+    PlaybackSnapshot snap{};
+    snap.file_id = s.file_id;
+    snap.playing = s.playing;
+    snap.paused = s.paused;
+    snap.suspended = s.suspended;
+    if (s.playing) {
+        snap.sample_rate = s.track->decoder.outputSampleRate;
+        snap.length = s.total_frames;
+        snap.period_frames = s.device.playback.internalPeriodSizeInFrames;
+        snap.periods = s.device.playback.internalPeriods;
     }
+    snprintf(snap.file_name, sizeof(snap.file_name), "%s", s.current_file.c_str());
+    publish_snapshot(s.snapshot, snap);
+    wake_ui();
+}
 
-    curl_easy_cleanup(curl);
+void post_event(PlaybackState &s, EngineEvent ev) {
+    s.events.push(std::move(ev));
+    wake_ui();
+}
 
-    std::string html(response_data.begin(), response_data.end());
+PlaybackSnapshot playback_snapshot(const PlaybackState &s) {
+    PlaybackSnapshot snap = read_snapshot(s.snapshot);
+    snap.position = s.current_frame.load();
+    return snap;
+}
 
-    std::regex href_regex(R"(<a\s+href=["']([^"'>]+)["'])", std::regex::icase);
-    auto begin = std::sregex_iterator(html.begin(), html.end(), href_regex);
-    auto end = std::sregex_iterator();
+// Interactive playback tops the ring up a chunk at a time; the conservative
+// profile lets it drain to the refill mark and then decodes in one burst.
+void set_decode_ahead(PlaybackState &s) {
+    ma_uint32 capacity = ma_pcm_rb_get_subbuffer_size(&s.ring);
+    ma_uint32 rate = s.track->decoder.outputSampleRate;
+    if (s.profile == PROFILE_CONSERVATIVE) {
+        s.ahead_frames = std::min(capacity, (ma_uint32)((ma_uint64)CONSERVATIVE_AHEAD_MS * rate / 1000));
+        s.refill_frames = std::min(s.ahead_frames.load(), (ma_uint32)((ma_uint64)CONSERVATIVE_REFILL_MS * rate / 1000));
+        return;
+    }
+    ma_uint32 frames = (ma_uint32)((ma_uint64)LATENCY_LADDER[s.latency_level].aheadMs * rate / 1000);
+    s.ahead_frames = std::min(capacity, std::max(frames, 2 * DECODE_CHUNK_FRAMES));
+    s.refill_frames = s.ahead_frames - DECODE_CHUNK_FRAMES;
+}
 
-    for (auto i = begin; i != end; ++i) {
-        std::string link = (*i)[1].str();
-        if (link == "../" || link.back() == '/') continue;
-        if (is_music_file(link)) {
-            files.push_back(link);
-        }
+ma_result open_device(PlaybackState &s) {
+    const LatencyLevel &level = LATENCY_LADDER[s.latency_level];
+    ma_device_config cfg = ma_device_config_init(ma_device_type_playback);
+    const ma_decoder &decoder = s.track->decoder;
+    cfg.playback.format = decoder.outputFormat;
+    cfg.playback.channels = decoder.outputChannels;
+    cfg.sampleRate = decoder.outputSampleRate;
+    cfg.dataCallback = data_callback;
+    cfg.pUserData = &s;
+    if (s.profile == PROFILE_CONSERVATIVE) {
+        cfg.performanceProfile = ma_performance_profile_conservative;
+        cfg.periodSizeInMilliseconds = CONSERVATIVE_PERIOD_MS;
+        cfg.periods = CONSERVATIVE_PERIODS;
+    } else {
+        cfg.performanceProfile = ma_performance_profile_low_latency;
+        cfg.periodSizeInFrames = level.periodFrames;
+        cfg.periods = level.periods;
     }
 
+    s.audio_tid = 0;
+    s.last_callback_ns = 0;
+    ma_result result = ma_device_init(s.context_ready ? &s.context : NULL, &cfg, &s.device);
+    if (result == MA_SUCCESS && !s.suspended) result = ma_device_start(&s.device);
+    return result;
+}
 
-    return files;
+void wake_playback_threads(PlaybackState &s) {
+    std::lock_guard<std::mutex> lock(s.wake_mx);
+    s.wake_cv.notify_all();
 }
 
-struct MemoryFile {
-    const char* data;
-    size_t size;
-    size_t offset;
-};
+void release_track(PlaybackState &s) {
+    ma_device_stop(&s.device);
+    ma_device_uninit(&s.device);
+    s.decode_stop = true;
+    s.suspended = false;
+    wake_playback_threads(s);
+    if (s.track && s.track->reader.stream) close_stream(*s.track->reader.stream);
+    if (s.decode_thread.joinable()) s.decode_thread.join();
+    ma_pcm_rb_uninit(&s.ring);
+    arena_free(s.ring_storage, &g_audio_arena);
+    s.ring_storage = nullptr;
+    if (s.track && !s.track->local.truncated) pool_park(s.pool, std::move(s.track));
+    s.track.reset();
+}
 
-static ma_result memory_read(ma_decoder* pDecoder, void* pBuffer, size_t bytesToRead, size_t* bytesRead) {
-    MemoryFile* mem = (MemoryFile*)pDecoder->pUserData;
-    if (mem->offset + bytesToRead > mem->size) {
-        bytesToRead = mem->size - mem->offset;
-    }
-    memcpy(pBuffer, mem->data + mem->offset, bytesToRead);
-    mem->offset += bytesToRead;
-    *bytesRead = bytesToRead;
-    return MA_SUCCESS;
+// The device could not be reopened mid-track: stop as a failed start would and tell the UI.
+void fail_playback(PlaybackState &s) {
+    EngineEvent ev;
+    ev.type = EVT_FAILED;
+    ev.generation = s.active_generation;
+    if (s.track) ev.path = s.track->path;
+    s.stop_requested = true;
+    s.playing = false;
+    s.paused = false;
+    release_track(s);
+    post_event(s, std::move(ev));
 }
 
-static ma_result memory_seek(ma_decoder* pDecoder, ma_int64 offset, ma_seek_origin origin) {
-    MemoryFile* mem = (MemoryFile*)pDecoder->pUserData;
-    int64_t newOffset = 0;
+void set_latency_level(PlaybackState &s, int level) {
+    std::lock_guard<std::mutex> lock(s.mx);
+    if (!s.playing || s.suspended || level == s.latency_level) return;
 
-    if (origin == ma_seek_origin_start) {
-        newOffset = offset;
-    } else if (origin == ma_seek_origin_current) {
-        newOffset = (int64_t)mem->offset + offset;
-    } else if (origin == ma_seek_origin_end) {
-        newOffset = (int64_t)mem->size + offset;
+    int previous = s.latency_level;
+    s.latency_level = level;
+    set_decode_ahead(s);
+    ma_device_uninit(&s.device);
+    if (open_device(s) != MA_SUCCESS) {
+        s.latency_level = previous;
+        set_decode_ahead(s);
+        if (open_device(s) != MA_SUCCESS) fail_playback(s);
     }
+    publish_playback(s);
+}
 
-    if (newOffset < 0 || newOffset > (int64_t)mem->size) return MA_INVALID_ARGS;
+void set_power_profile(PlaybackState &s, PowerProfile profile) {
+    std::lock_guard<std::mutex> lock(s.mx);
+    if (s.profile == profile) return;
 
-    mem->offset = (size_t)newOffset;
-    return MA_SUCCESS;
+    s.profile = profile;
+    if (!s.playing) return;
+    set_decode_ahead(s);
+    ma_device_uninit(&s.device);
+    if (open_device(s) != MA_SUCCESS) fail_playback(s);
+    publish_playback(s);
 }
 
+bool init_audio_engine(PlaybackState &s) {
+    init_audio_arena(g_audio_arena, AUDIO_ARENA_SIZE);
+    s.pool.budget = decoder_pool_budget();
 
-std::vector<char> fetch_remote_file(const std::string& url, const std::string& username, const std::string& password) {
-    std::vector<char> file_data;
-    CURL* curl = curl_easy_init();
-    if (!curl) return file_data;
+    ma_context_config cc = ma_context_config_init();
+    cc.allocationCallbacks = audio_arena_callbacks();
+    s.context_ready = ma_context_init(NULL, 0, &cc, &s.context) == MA_SUCCESS;
+    return s.context_ready;
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_memory_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &file_data);
+void uninit_audio_engine(PlaybackState &s) {
+    pool_clear(s.pool);
+    if (s.context_ready) ma_context_uninit(&s.context);
+    s.context_ready = false;
+}
 
-    if (!username.empty()) {
-        std::string userpass = username + ":" + password;
-        curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
-        curl_easy_setopt(curl, CURLOPT_USERPWD, userpass.c_str());
+// Remote starts wait for N seconds of audio past the header. The bitrate is
+// what the decoder consumed for the first ring fill; N grows with the shortfall
+// of the measured throughput against it so the rest of the track still
+// arrives before the playhead catches up.
+bool wait_for_watermark(PlaybackState &s, size_t header_bytes) {
+    StreamReader &reader = s.track->reader;
+    RemoteStream &stream = *reader.stream;
+    ma_uint32 rate = s.track->decoder.outputSampleRate;
+    for (;;) {
+        if (s.load_generation != s.active_generation) return false;
+
+        ma_uint32 decoded = ma_pcm_rb_available_read(&s.ring);
+        size_t received, consumed;
+        curl_off_t length;
+        double throughput = 0;
+        {
+            std::lock_guard<std::mutex> lock(stream.mx);
+            if (stream.done) return !stream.failed || stream.end > header_bytes;
+            if (stream.writer_blocked) return true;
+            received = stream.end;
+            consumed = reader.offset;
+            length = stream.content_length;
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - stream.first_byte_at).count();
+            if (received > 0 && elapsed >= std::chrono::duration<double>(THROUGHPUT_SAMPLE_TIME).count()) {
+                throughput = received / elapsed;
+            }
+        }
+        if (s.decoder_eof) return true;
+
+        if (decoded >= s.ahead_frames && consumed > header_bytes) {
+            double bitrate = (double)(consumed - header_bytes) * rate / decoded;
+            double seconds = WATERMARK_DEFAULT_SECONDS;
+            if (throughput > 0 && length > 0) {
+                double duration = (length - header_bytes) / bitrate;
+                seconds = WATERMARK_MIN_SECONDS + std::max(0.0, duration * (1.0 - throughput / bitrate));
+            }
+            s.watermark_ms = (int)(seconds * 1000);
+            if (received >= header_bytes + seconds * bitrate) {
+                if (!s.length_exact && length > 0) s.total_frames = (ma_uint64)((length - header_bytes) / bitrate * rate);
+                return true;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
     }
+}
 
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        curl_easy_cleanup(curl);
-        file_data.clear();
-        return file_data;
+// miniaudio probes WAV, FLAC, MP3 and Vorbis in turn unless told the format,
+// and every failed probe reads (and, for remote tracks, may seek) the stream.
+// The first bytes settle it for all but headerless MP3 data, where the
+// extension decides. A wrong guess falls back to probing, since miniaudio
+// gives up as soon as the named backend refuses the stream.
+static const size_t SNIFF_BYTES = 64;
+static const char* ENCODING_FORMAT_NAMES[] = {"probed", "wav", "flac", "mp3", "vorbis"};
+
+ma_encoding_format sniff_encoding_format(const unsigned char* head, size_t length, const std::string &path) {
+    std::string ext = path.substr(path.find_last_of('.') + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    auto starts = [&](size_t at, const char* magic) {
+        size_t n = strlen(magic);
+        return length >= at + n && memcmp(head + at, magic, n) == 0;
+    };
+    if ((starts(0, "RIFF") || starts(0, "RF64")) && starts(8, "WAVE")) return ma_encoding_format_wav;
+    if (starts(0, "riff")) return ma_encoding_format_wav;
+    if (starts(0, "fLaC")) return ma_encoding_format_flac;
+    if (starts(0, "OggS")) {
+        if (starts(28, "\x01vorbis")) return ma_encoding_format_vorbis;
+        if (starts(28, "\x7f" "FLAC")) return ma_encoding_format_flac;
+        return ma_encoding_format_unknown;
     }
+    if (starts(0, "ID3")) return ext == "flac" ? ma_encoding_format_flac : ma_encoding_format_mp3;
+    if (length >= 2 && head[0] == 0xFF && (head[1] & 0xE0) == 0xE0) return ma_encoding_format_mp3;
+    if (ext == "mp3") return ma_encoding_format_mp3;
+    if (ext == "flac") return ma_encoding_format_flac;
+    if (ext == "wav") return ma_encoding_format_wav;
+    if (ext == "ogg") return ma_encoding_format_vorbis;
+    return ma_encoding_format_unknown;
+}
 
-    curl_easy_cleanup(curl);
-    return file_data;
+ma_result init_decoder(ma_decoder_read_proc onRead, ma_decoder_seek_proc onSeek, void* user, ma_decoder_config config,
+                       ma_encoding_format format, ma_decoder* decoder, bool* guessed_wrong = nullptr) {
+    config.encodingFormat = format;
+    ma_result result = ma_decoder_init(onRead, onSeek, user, &config, decoder);
+    if (guessed_wrong) *guessed_wrong = false;
+    if (result != MA_SUCCESS && format != ma_encoding_format_unknown) {
+        if (guessed_wrong) *guessed_wrong = true;
+        config.encodingFormat = ma_encoding_format_unknown;
+        result = ma_decoder_init(onRead, onSeek, user, &config, decoder);
+    }
+    return result;
 }
 
-struct PlaybackState {
-    ma_decoder decoder{};
-    ma_device device{};
-    std::atomic<bool> playing{false};
-    std::atomic<bool> stop_requested{false};
-    std::mutex mx;
-    std::atomic<ma_uint64> current_frame{0};
-    std::atomic<ma_uint64> total_frames{0};
-    std::string current_file;
-    std::atomic<bool> paused{false};
+// Only MP3 has to be scanned end to end for its length; the others carry it in the header.
+bool length_needs_scan(const std::string &filepath) {
+    std::string ext = filepath.substr(filepath.find_last_of('.') + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == "mp3";
+}
 
-    std::atomic<bool> track_finished{false};
+// Opens a track into a fresh slot, sniffing the format first. Remote tracks
+// take over the prefetched transfer when it is for the same URL. Warm opens
+// (local only, from the warm worker) are counted apart from playback starts.
+std::unique_ptr<DecoderSlot> open_decoder(PlaybackState &s, const std::string &filepath, bool is_remote,
+                                          const std::string &username, const std::string &password, int64_t size,
+                                          bool warm = false) {
+    std::unique_ptr<DecoderSlot> slot(new DecoderSlot());
+    slot->path = filepath;
+    slot->remote = is_remote;
 
+    ma_result result;
+    ma_decoder_config config;
+    ma_encoding_format format;
+    int64_t init_started;
+    bool guessed_wrong = false;
+    if (is_remote) {
+        StreamReader &reader = slot->reader;
+        FetchCancel cancel{&s.load_generation, s.active_generation};
+        if (s.prefetch && s.prefetch_url == filepath && !stream_failed(*s.prefetch->stream)) {
+            reader.request = std::move(s.prefetch);
+            s.prefetch_url.clear();
+        } else {
+            reader.request = make_net_request(NET_DOWNLOAD, filepath, username, password, size);
+            net_submit(g_net, reader.request);
+        }
+        reader.request->cancel_when_stale(cancel);
+        reader.request->priority = PRIO_PLAYBACK;
+        net_wakeup(g_net);
 
-    std::vector<char> remote_file_data;
-    MemoryFile mem_file{};
-};
+        reader.stream = reader.request->stream;
+        reader.offset = 0;
+        reader.stalled = &s.network_stall;
 
-void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount) {
-    auto* state = (PlaybackState*)pDevice->pUserData;
-    if (!state) {
-        memset(pOutput, 0, frameCount * ma_get_bytes_per_frame(ma_format_f32, 2));
-        return;
+        size_t got = 0;
+        unsigned char head[SNIFF_BYTES];
+        stream_read_bytes(&reader, head, sizeof(head), &got);
+        reader.offset = 0;
+        format = sniff_encoding_format(head, got, url_decode(filepath));
+        init_started = steady_ns();
+        config = ma_decoder_config_init(ma_format_f32, 2, 44100);
+        config.allocationCallbacks = slot_callbacks(slot.get());
+        result = init_decoder(stream_read, stream_seek, &reader, config, format, &slot->decoder, &guessed_wrong);
+    } else {
+        LocalReader &local = slot->local;
+        if (!local_open(local, filepath, local_map_reads())) return nullptr;
+        local.hits = warm ? &s.pool.warm_reads : &s.local_hits;
+        local.misses = warm ? &s.pool.warm_reads : &s.local_misses;
+        struct stat st;
+        if (fstat(local.fd, &st) == 0) {
+            slot->dev = st.st_dev;
+            slot->ino = st.st_ino;
+            slot->mtime = st.st_mtime;
+        }
+        unsigned char head[SNIFF_BYTES];
+        format = sniff_encoding_format(head, local_peek(local, head, sizeof(head)), filepath);
+        init_started = steady_ns();
+        config = ma_decoder_config_init(ma_format_f32, 0, 0);
+        config.allocationCallbacks = slot_callbacks(slot.get());
+        result = init_decoder(local_read, local_seek, &local, config, format, &slot->decoder, &guessed_wrong);
     }
 
-    if (state->paused) {
-        memset(pOutput, 0, frameCount * ma_get_bytes_per_frame(pDevice->playback.format, pDevice->playback.channels));
-        return;
+    if (result != MA_SUCCESS) return nullptr;
+    slot->ready = true;
+
+    int64_t init_us = (steady_ns() - init_started) / 1000;
+    if (warm) {
+        s.pool.warms++;
+        s.pool.warm_total_us += init_us;
+        return slot;
     }
+    s.last_init_us = init_us;
+    s.init_total_us += init_us;
+    s.inits++;
+    if (guessed_wrong) s.init_fallbacks++;
+    s.last_format = guessed_wrong ? ma_encoding_format_unknown : format;
+    return slot;
+}
 
-    ma_uint64 framesRead = 0;
-    ma_result result = ma_decoder_read_pcm_frames(&state->decoder, pOutput, frameCount, &framesRead);
-    
-    ma_uint64 cur;
-    ma_decoder_get_cursor_in_pcm_frames(&state->decoder, &cur);
-    state->current_frame = cur;
+// Initializes a local track's decoder ahead of time and parks it in the pool,
+// length included, so playing it later only swaps the slot in.
+void warm_decoder(PlaybackState &s, const std::string &filepath) {
+    if (pool_touch(s.pool, filepath)) return;
+    std::unique_ptr<DecoderSlot> slot = open_decoder(s, filepath, false, "", "", -1, true);
+    if (!slot) return;
+    ma_decoder_get_length_in_pcm_frames(&slot->decoder, &slot->length);
+    slot->length_known = true;
+    pool_park(s.pool, std::move(slot));
+}
 
-    if (result != MA_SUCCESS || framesRead < frameCount) {
-        size_t bytesPerFrame = ma_get_bytes_per_frame(ma_format_f32, state->decoder.outputChannels);
-        size_t bytesToClear = (frameCount - framesRead) * bytesPerFrame;
-        char* p = (char*)pOutput;
-        memset(p + framesRead * bytesPerFrame, 0, bytesToClear);
+// Warms one row at a time off the engine thread, so an MP3 length scan never
+// holds up a play command. Only the latest request is kept.
+void warm_loop(PlaybackState* s) {
+    apply_thread_role(ROLE_ANALYSIS);
+    for (;;) {
+        std::string path;
+        bool prefetch = false;
+        {
+            std::unique_lock<std::mutex> lock(s->warm_mx);
+            s->warm_cv.wait(lock, [s] { return s->warm_quit || !s->warm_next.empty() || !s->prefetch_next.empty(); });
+            if (s->warm_quit) return;
+            prefetch = !s->prefetch_next.empty();
+            if (prefetch) {
+                path = std::move(s->prefetch_next.front());
+                s->prefetch_next.pop_front();
+            } else {
+                path.swap(s->warm_next);
+            }
+        }
+        if (prefetch) local_prefetch(path);
+        else warm_decoder(*s, path);
     }
 }
 
-bool start_playback(PlaybackState &s, const std::string &filepath, bool is_remote, const std::string& username = "", const std::string& password = "") {
+bool start_playback(PlaybackState &s, const std::string &filepath, bool is_remote, const std::string& username = "",
+                    const std::string& password = "", int64_t size = -1) {
     std::lock_guard<std::mutex> lock(s.mx);
+    s.start_ns = steady_ns();
+    s.ttfa_pending = false;
+    s.ttfa_remote = is_remote;
     
     if (s.playing) {
         s.stop_requested = true;
-        ma_device_stop(&s.device);
-        ma_device_uninit(&s.device);
-        ma_decoder_uninit(&s.decoder);
-        s.remote_file_data.clear();
+        release_track(s);
         s.playing = false;
+        publish_playback(s);
     }
 
-    ma_result result;
-    if (is_remote) {
-        s.remote_file_data = fetch_remote_file(filepath, username, password);
-        if (s.remote_file_data.empty()) return false;
-
-        s.mem_file.data = s.remote_file_data.data();
-        s.mem_file.size = s.remote_file_data.size();
-        s.mem_file.offset = 0;
-        s.decoder.pUserData = &s.mem_file;
-
-        ma_decoder_config config = ma_decoder_config_init(ma_format_f32, 2, 44100);
-        result = ma_decoder_init(memory_read, memory_seek, &s.mem_file, &config, &s.decoder);
-    } else {
-        result = ma_decoder_init_file(filepath.c_str(), NULL, &s.decoder);
+    if (!is_remote) {
+        s.track = pool_take(s.pool, filepath);
+        if (s.track) {
+            s.pool.hits++;
+            s.track->local.hits = &s.local_hits;
+            s.track->local.misses = &s.local_misses;
+        } else {
+            s.pool.misses++;
+        }
     }
-
-    if (result != MA_SUCCESS) return false;
+    if (!s.track) s.track = open_decoder(s, filepath, is_remote, username, password, size);
+    if (!s.track) return false;
+    DecoderSlot &track = *s.track;
 
     s.current_file = url_decode(filepath.substr(filepath.find_last_of("/") + 1));
 
 
-    ma_uint64 length;
-    ma_decoder_get_length_in_pcm_frames(&s.decoder, &length);
-    s.total_frames = length;
+    size_t header_bytes = track.reader.offset;
+    s.length_exact = !is_remote || stream_complete(*track.reader.stream) || !length_needs_scan(filepath);
+    if (s.length_exact && !track.length_known) {
+        ma_decoder_get_length_in_pcm_frames(&track.decoder, &track.length);
+        track.length_known = true;
+    }
+    s.total_frames = s.length_exact ? track.length : 0;
+    s.watermark_ms = 0;
 
-    ma_device_config cfg = ma_device_config_init(ma_device_type_playback);
-    cfg.playback.format = s.decoder.outputFormat;
-    cfg.playback.channels = s.decoder.outputChannels;
-    cfg.sampleRate = s.decoder.outputSampleRate;
-    cfg.dataCallback = data_callback;
-    cfg.pUserData = &s;
-    cfg.performanceProfile = ma_performance_profile_low_latency;
+    ma_uint32 ringFrames = (ma_uint32)((ma_uint64)track.decoder.outputSampleRate * RING_CAPACITY_MS / 1000);
+    size_t ringBytes = ringFrames * ma_get_bytes_per_frame(ma_format_f32, track.decoder.outputChannels);
+    s.ring_storage = arena_malloc(ringBytes, &g_audio_arena);
+    if (!s.ring_storage) {
+        s.track.reset();
+        return false;
+    }
+    prefault_and_lock(s.ring_storage, ringBytes);
+    ma_allocation_callbacks ringCallbacks = audio_arena_callbacks();
+    ma_pcm_rb_init(ma_format_f32, track.decoder.outputChannels, ringFrames, s.ring_storage, &ringCallbacks, &s.ring);
+    set_decode_ahead(s);
 
-    result = ma_device_init(NULL, &cfg, &s.device);
-    if (result != MA_SUCCESS) {
-        ma_decoder_uninit(&s.decoder);
-        s.remote_file_data.clear();
+    s.decode_stop = false;
+    s.decoder_eof = false;
+    s.drained = false;
+    s.current_frame = 0;
+    s.decode_thread = std::thread(decode_loop, &s);
+
+    if (is_remote && !wait_for_watermark(s, header_bytes)) {
+        release_track(s);
         return false;
     }
 
-    result = ma_device_start(&s.device);
+    s.ttfa_pending = true;
+    ma_result result = open_device(s);
     if (result != MA_SUCCESS) {
-        ma_device_uninit(&s.device);
-        ma_decoder_uninit(&s.decoder);
-        s.remote_file_data.clear();
+        release_track(s);
         return false;
     }
 
     s.stop_requested = false;
     s.playing = true;
     s.paused = false;
-    s.current_frame = 0;
+    s.file_id++;
+    publish_playback(s);
 
     return true;
 }
@@ -313,16 +3712,226 @@ void stop_playback(PlaybackState &s) {
     s.stop_requested = true;
     s.playing = false;
     s.paused = false;
-    ma_device_stop(&s.device);
-    ma_device_uninit(&s.device);
-    ma_decoder_uninit(&s.decoder);
-    s.remote_file_data.clear();
+    release_track(s);
+    publish_playback(s);
 }
 
 void toggle_pause(PlaybackState &s) {
     std::lock_guard<std::mutex> lock(s.mx);
     if (!s.playing) return;
     s.paused = !s.paused;
+    if (s.paused) {
+        s.paused_at = std::chrono::steady_clock::now();
+    } else if (s.suspended) {
+        s.last_callback_ns = 0;
+        ma_device_start(&s.device);
+        s.suspended = false;
+        wake_playback_threads(s);
+    }
+    publish_playback(s);
+}
+
+// The callback only emits silence while paused, so the device can be stopped
+// without losing anything: the decoder cursor and the ring are left as they are.
+void suspend_if_idle(PlaybackState &s) {
+    std::lock_guard<std::mutex> lock(s.mx);
+    if (!s.playing || !s.paused || s.suspended) return;
+    if (std::chrono::steady_clock::now() - s.paused_at < PAUSE_SUSPEND_GRACE) return;
+    ma_device_stop(&s.device);
+    s.suspended = true;
+    publish_playback(s);
+}
+
+void adapt_latency(PlaybackState &s, ma_uint64 &seen_underruns,
+                   std::chrono::steady_clock::time_point &last_trouble,
+                   std::vector<std::chrono::steady_clock::time_point> &recent) {
+    auto now = std::chrono::steady_clock::now();
+    ma_uint64 total = s.underruns + s.late_callbacks;
+    if (s.paused || s.profile == PROFILE_CONSERVATIVE) {
+        seen_underruns = total;
+        return;
+    }
+    for (; seen_underruns < total; seen_underruns++) recent.push_back(now);
+    recent.erase(std::remove_if(recent.begin(), recent.end(), [&](const std::chrono::steady_clock::time_point &t) {
+        return now - t > UNDERRUN_WINDOW;
+    }), recent.end());
+
+    int level = s.latency_level;
+    if ((int)recent.size() >= UNDERRUNS_TO_GROW && level + 1 < LATENCY_LEVELS) {
+        set_latency_level(s, level + 1);
+        recent.clear();
+        seen_underruns = s.underruns + s.late_callbacks;
+        last_trouble = now;
+    } else if (!recent.empty()) {
+        last_trouble = now;
+    } else if (level > 0 && now - last_trouble > STABLE_TO_SHRINK) {
+        set_latency_level(s, level - 1);
+        last_trouble = now;
+    }
+}
+
+void playback_monitor(PlaybackState* s) {
+    ma_uint64 seen_underruns = s->underruns + s->late_callbacks;
+    auto last_trouble = std::chrono::steady_clock::now();
+    std::vector<std::chrono::steady_clock::time_point> recent;
+
+    while (s->playing && !s->stop_requested) {
+        ma_uint64 cur = s->current_frame.load();
+        ma_uint64 len = s->total_frames.load();
+        if ((s->length_exact && len > 0 && cur >= len) || s->drained) {
+            EngineEvent ev;
+            ev.type = EVT_TRACK_FINISHED;
+            ev.generation = s->active_generation;
+            post_event(*s, std::move(ev));
+            return;
+        }
+        pid_t audio_tid = s->audio_tid;
+        if (audio_tid && audio_tid != s->audio_role_tid) {
+            apply_thread_role(ROLE_AUDIO, audio_tid);
+            s->audio_role_tid = audio_tid;
+        }
+        adapt_latency(*s, seen_underruns, last_trouble, recent);
+        suspend_if_idle(*s);
+        if (s->suspended) {
+            std::unique_lock<std::mutex> lock(s->wake_mx);
+            s->wake_cv.wait(lock, [s] { return !s->suspended || s->stop_requested; });
+            continue;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(s->profile == PROFILE_CONSERVATIVE ? 500 : 100));
+    }
+}
+
+void stop_track_and_monitor(PlaybackState &s) {
+    stop_playback(s);
+    if (s.monitor_thread.joinable()) s.monitor_thread.join();
+}
+
+void engine_loop(PlaybackState* s) {
+    std::vector<EngineCommand> batch;
+    for (;;) {
+        while (sem_wait(&s->command_sem) != 0 && errno == EINTR) {}
+
+        batch.clear();
+        EngineCommand cmd;
+        while (s->commands.pop(cmd)) batch.push_back(std::move(cmd));
+
+        for (EngineCommand &c : batch) {
+            switch (c.type) {
+                case CMD_PLAY: {
+                    if (c.generation != s->load_generation) break;
+                    stop_track_and_monitor(*s);
+                    s->active_generation = c.generation;
+                    bool ok = start_playback(*s, c.path, c.remote, c.username, c.password, c.size);
+                    if (ok) s->monitor_thread = std::thread(playback_monitor, s);
+                    if (!ok && c.generation != s->load_generation) break;
+                    EngineEvent ev;
+                    ev.type = ok ? EVT_STARTED : EVT_FAILED;
+                    ev.generation = c.generation;
+                    ev.path = c.path;
+                    post_event(*s, std::move(ev));
+                    break;
+                }
+                case CMD_WARM: {
+                    if (s->track && s->track->path == c.path) break;
+                    std::lock_guard<std::mutex> lock(s->warm_mx);
+                    s->warm_next = c.path;
+                    s->warm_cv.notify_one();
+                    break;
+                }
+                case CMD_PREFETCH:
+                    if (!c.remote) {
+                        std::lock_guard<std::mutex> lock(s->warm_mx);
+                        s->prefetch_next.push_back(c.path);
+                        if ((int)s->prefetch_next.size() > LOCAL_PREFETCH_TRACKS) s->prefetch_next.pop_front();
+                        s->warm_cv.notify_one();
+                        break;
+                    }
+                    if (c.path == s->prefetch_url) break;
+                    if (s->prefetch) net_cancel(g_net, s->prefetch->id);
+                    s->prefetch = make_net_request(NET_PREFETCH, c.path, c.username, c.password, c.size);
+                    s->prefetch_url = c.path;
+                    net_submit(g_net, s->prefetch);
+                    break;
+                case CMD_TOGGLE_PAUSE:
+                    toggle_pause(*s);
+                    break;
+                case CMD_STOP:
+                    stop_track_and_monitor(*s);
+                    break;
+                case CMD_SET_PROFILE:
+                    set_power_profile(*s, (PowerProfile)c.profile);
+                    break;
+                case CMD_QUIT:
+                    stop_track_and_monitor(*s);
+                    if (s->prefetch) net_cancel(g_net, s->prefetch->id);
+                    s->prefetch.reset();
+                    return;
+            }
+        }
+    }
+}
+
+// Play, stop and quit supersede whatever load is in flight, so they bump the generation first.
+bool send_command(PlaybackState &s, EngineCommand cmd) {
+    if (cmd.type == CMD_PLAY || cmd.type == CMD_STOP || cmd.type == CMD_QUIT) {
+        cmd.generation = ++s.load_generation;
+        net_wakeup(g_net);
+    }
+    if (!s.commands.push(std::move(cmd))) return false;
+    sem_post(&s.command_sem);
+    return true;
+}
+
+void start_engine(PlaybackState &s) {
+    sem_init(&s.command_sem, 0, 0);
+    s.engine_thread = std::thread(engine_loop, &s);
+    s.warm_thread = std::thread(warm_loop, &s);
+}
+
+void stop_engine(PlaybackState &s) {
+    EngineCommand quit;
+    quit.type = CMD_QUIT;
+    while (!send_command(s, quit)) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    s.engine_thread.join();
+    {
+        std::lock_guard<std::mutex> lock(s.warm_mx);
+        s.warm_quit = true;
+        s.warm_cv.notify_one();
+    }
+    s.warm_thread.join();
+    sem_destroy(&s.command_sem);
+}
+
+struct RateMeter {
+    double last_value = -1;
+    std::chrono::steady_clock::time_point last_time;
+    double per_second = 0;
+};
+
+void sample_rate(RateMeter &m, double value) {
+    auto now = std::chrono::steady_clock::now();
+    if (m.last_value >= 0 && now - m.last_time < std::chrono::seconds(1)) return;
+    if (m.last_value >= 0) {
+        m.per_second = (value - m.last_value) / std::chrono::duration<double>(now - m.last_time).count();
+    }
+    m.last_value = value;
+    m.last_time = now;
+}
+
+struct UiMeters {
+    RateMeter wakeups;
+    RateMeter net_classes[PRIO_COUNT];
+};
+
+long process_wakeups() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+void sample_meters(UiMeters &m) {
+    sample_rate(m.wakeups, process_wakeups());
+    for (int p = 0; p < PRIO_COUNT; p++) sample_rate(m.net_classes[p], g_net.class_bytes[p].load());
 }
 
 void draw_separator(int y, int w) {
@@ -331,8 +3940,15 @@ void draw_separator(int y, int w) {
     attroff(COLOR_PAIR(COLOR_HEADER));
 }
 
-void draw_playback_bar(int h, int w, PlaybackState &state) {
-    if (!state.playing) {
+void draw_playback_bar(int h, int w, const PlaybackSnapshot &snap, const std::string &status) {
+    if (!status.empty()) {
+        attron(COLOR_PAIR(COLOR_PLAYBACK));
+        mvprintw(h - 2, 0, "%s", status.c_str());
+        attroff(COLOR_PAIR(COLOR_PLAYBACK));
+        if (!snap.playing) return;
+    }
+
+    if (!snap.playing) {
         attron(COLOR_PAIR(COLOR_PLAYBACK));
         mvprintw(h - 2, 0, "No track selected");
         mvprintw(h - 1, 0, "Press ENTER to play selected track");
@@ -340,17 +3956,11 @@ void draw_playback_bar(int h, int w, PlaybackState &state) {
         return;
     }
 
-    ma_uint64 cur = state.current_frame.load();
-    ma_uint64 len = state.total_frames.load();
+    ma_uint64 cur = snap.position;
+    ma_uint64 len = snap.length;
 
     if (len > 0) {
-        double sampleRate = 44100;
-        {
-            std::lock_guard<std::mutex> lock(state.mx);
-            if (state.playing && state.decoder.outputSampleRate > 0) {
-                sampleRate = state.decoder.outputSampleRate;
-            }
-        }
+        double sampleRate = snap.sample_rate > 0 ? snap.sample_rate : 44100;
 
         double pos_sec = double(cur) / sampleRate;
         double dur_sec = double(len) / sampleRate;
@@ -358,8 +3968,8 @@ void draw_playback_bar(int h, int w, PlaybackState &state) {
         int filled = std::min(bar_w, static_cast<int>((pos_sec / dur_sec) * bar_w));
         
         attron(COLOR_PAIR(COLOR_PLAYBACK));
-        std::string decoded_name = url_decode(state.current_file);
-        mvprintw(h - 2, 0, "%s %s", state.paused ? "Paused - " : "Playing - ", decoded_name.c_str());
+        std::string decoded_name = url_decode(snap.file_name);
+        if (status.empty()) mvprintw(h - 2, 0, "%s %s", snap.paused ? "Paused - " : "Playing - ", decoded_name.c_str());
 
         
         attron(COLOR_PAIR(COLOR_PROGRESS));
@@ -372,17 +3982,94 @@ void draw_playback_bar(int h, int w, PlaybackState &state) {
     }
 }
 
-void draw_header(int w, const std::string &path) {
+void draw_header(int w, const std::string &path, const char* library) {
     attron(COLOR_PAIR(COLOR_HEADER) | A_BOLD);
     mvprintw(0, 0, "COOKIE PLAYER");
+    attroff(A_BOLD);
+    mvprintw(0, 15, "%s", library);
+    attron(A_BOLD);
     mvprintw(0, w - (int)path.length() - 1, "%s", path.c_str());
     attroff(COLOR_PAIR(COLOR_HEADER) | A_BOLD);
 }
 
 void draw_footer(int h, int w) {
     attron(COLOR_PAIR(COLOR_HEADER) | A_BOLD);
-    mvprintw(h - 3, 0, "Controls: UP/DOWN Navigate | ENTER Play | SPACE Pause | q Quit");
+    mvprintw(h - 3, 0, "Controls: UP/DOWN Navigate | ENTER Play | SPACE Pause | s Stats | q Quit");
+    attroff(COLOR_PAIR(COLOR_HEADER) | A_BOLD);
+}
+
+void draw_stats(int h, const PlaybackState &state, const PlaybackSnapshot &snap, const UiMeters &meters) {
+    int y = 2;
+    attron(COLOR_PAIR(COLOR_HEADER) | A_BOLD);
+    mvprintw(y++, 0, "%-10s %-8s %-14s %-28s %s", "Thread", "TID", "Requested", "Effective", "CPUs");
+    attroff(COLOR_PAIR(COLOR_HEADER) | A_BOLD);
+
+    attron(COLOR_PAIR(COLOR_LIST));
+    {
+        std::lock_guard<std::mutex> lock(g_role_mx);
+        for (int r = 0; r < ROLE_COUNT && y < h - 5; r++, y++) {
+            const ThreadRoleStatus &st = g_role_status[r];
+            mvprintw(y, 0, "%-10s %-8s %-14s %-28s %s", THREAD_ROLE_NAMES[r],
+                     st.tid ? std::to_string(st.tid).c_str() : "-",
+                     g_role_config[r].spec.c_str(), st.effective.c_str(), st.affinity.c_str());
+        }
+    }
+    attroff(COLOR_PAIR(COLOR_LIST));
+
+    y++;
+    if (y >= h - 5) return;
+    attron(COLOR_PAIR(COLOR_HEADER) | A_BOLD);
+    mvprintw(y++, 0, "Buffering");
     attroff(COLOR_PAIR(COLOR_HEADER) | A_BOLD);
+
+    attron(COLOR_PAIR(COLOR_LIST));
+    int level = state.latency_level;
+    if (y < h - 5) mvprintw(y++, 0, "  level %d/%d   period %u x %u frames (%.1f ms)   decode-ahead %u ms",
+                            level, LATENCY_LEVELS - 1, snap.period_frames, snap.periods,
+                            snap.sample_rate ? snap.period_frames * 1000.0 / snap.sample_rate : 0.0,
+                            LATENCY_LADDER[level].aheadMs);
+    if (y < h - 5) mvprintw(y++, 0, "  underruns %llu   late callbacks %llu   device %s",
+                            (unsigned long long)state.underruns.load(), (unsigned long long)state.late_callbacks.load(),
+                            !snap.playing ? "closed" : snap.suspended ? "suspended" : "running");
+    if (y < h - 5) mvprintw(y++, 0, "  profile %s   wakeups %.1f/s   audio arena %zu KiB, %s, %zu malloc fallbacks",
+                            POWER_PROFILE_NAMES[state.profile], meters.wakeups.per_second,
+                            g_audio_arena.capacity / 1024, g_audio_arena.locked ? "locked" : "not locked",
+                            g_audio_arena.fallback_allocs.load());
+    if (y < h - 5) mvprintw(y++, 0, "  network: %u active, %llu completed, %llu cancelled   windows %llu KiB, %llu refetches, %llu resumes",
+                            g_net.active_count.load(), (unsigned long long)g_net.completed.load(),
+                            (unsigned long long)g_net.cancelled.load(),
+                            (unsigned long long)(g_net.window_bytes / 1024), (unsigned long long)g_net.refetches.load(),
+                            (unsigned long long)g_net.resumes.load());
+    ma_uint64 local_starts = state.ttfa_starts[0], remote_starts = state.ttfa_starts[1];
+    if (y < h - 5) mvprintw(y++, 0, "  time to first audio: last %lld ms, avg local %lld ms (%llu), remote %lld ms (%llu)   watermark %.1f s",
+                            (long long)state.last_ttfa_ms.load(),
+                            local_starts ? (long long)(state.ttfa_total_ms[0] / (int64_t)local_starts) : 0LL,
+                            (unsigned long long)local_starts,
+                            remote_starts ? (long long)(state.ttfa_total_ms[1] / (int64_t)remote_starts) : 0LL,
+                            (unsigned long long)remote_starts, state.watermark_ms / 1000.0);
+    ma_uint64 inits = state.inits;
+    if (y < h - 5) mvprintw(y++, 0, "  decoder init: last %.1f ms (%s), avg %.1f ms over %llu, %llu wrong guesses",
+                            state.last_init_us / 1000.0, ENCODING_FORMAT_NAMES[state.last_format],
+                            inits ? state.init_total_us / 1000.0 / inits : 0.0,
+                            (unsigned long long)inits, (unsigned long long)state.init_fallbacks.load());
+    ma_uint64 hits = state.local_hits, misses = state.local_misses;
+    if (y < h - 5) mvprintw(y++, 0, "  local reads: %llu cached, %llu waited (%.0f%% hits)   readahead %lld KiB",
+                            (unsigned long long)hits, (unsigned long long)misses,
+                            hits + misses ? 100.0 * hits / (hits + misses) : 0.0, (long long)(local_readahead_bytes() / 1024));
+    ma_uint64 warms = state.pool.warms;
+    if (y < h - 5) mvprintw(y++, 0, "  decoder pool: %zu warm, %zu/%zu KiB   %llu hits, %llu misses   %llu warmed (avg %.1f ms)",
+                            state.pool.count.load(), state.pool.bytes / 1024, state.pool.budget / 1024,
+                            (unsigned long long)state.pool.hits.load(), (unsigned long long)state.pool.misses.load(),
+                            (unsigned long long)warms, warms ? state.pool.warm_total_us / 1000.0 / warms : 0.0);
+    if (y < h - 5) {
+        move(y++, 0);
+        printw("  ");
+        for (int p = 0; p < PRIO_COUNT; p++) {
+            printw("%s %.0fK/s %.0fK   ", NET_PRIORITY_NAMES[p],
+                   meters.net_classes[p].per_second / 1024.0, g_net.class_bytes[p].load() / 1024.0);
+        }
+    }
+    attroff(COLOR_PAIR(COLOR_LIST));
 }
 
 std::string get_input(const std::string &prompt, bool hide_input = false) {
@@ -408,16 +4095,196 @@ std::string get_input(const std::string &prompt, bool hide_input = false) {
     return std::string(input);
 }
 
+int run_power_benchmark(const std::string &file, int seconds) {
+    load_thread_roles();
+    PlaybackState state;
+    init_audio_engine(state);
+    bool remote = file.rfind("http://", 0) == 0 || file.rfind("https://", 0) == 0;
+
+    for (PowerProfile profile : {PROFILE_INTERACTIVE, PROFILE_CONSERVATIVE}) {
+        state.profile = profile;
+        if (!start_playback(state, file, remote)) {
+            std::cerr << "Cannot play " << file << "\n";
+            uninit_audio_engine(state);
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        long before = process_wakeups();
+        auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double rate = (process_wakeups() - before) / elapsed;
+        bool ended = state.drained;
+        stop_playback(state);
+
+        std::cout << POWER_PROFILE_NAMES[profile] << ": " << rate << " wakeups/s"
+                  << (ended ? " (track ended early, use a longer file)" : "") << "\n";
+    }
+
+    uninit_audio_engine(state);
+    return 0;
+}
+
+// Reads a remote file start to finish through the stream window, first over a
+// single connection and then in segments, and reports the throughput of each.
+// size_hint stands in for the size a listing reported, which may be wrong:
+// both passes must still read the whole file.
+int run_download_benchmark(const std::string &url, int segments, int64_t size_hint = -1) {
+    double rates[2] = {};
+    int counts[2] = {1, segments};
+    for (int i = 0; i < 2; i++) {
+        g_net.segments = counts[i];
+        StreamReader reader;
+        reader.request = make_net_request(NET_DOWNLOAD, url, "", "", size_hint);
+        reader.stream = reader.request->stream;
+        auto start = std::chrono::steady_clock::now();
+        net_submit(g_net, reader.request);
+
+        // Decoders read in uneven sizes, so reads straddle segment boundaries here too.
+        std::vector<char> chunk(60000);
+        size_t total = 0, got = 0;
+        while (stream_read_bytes(&reader, chunk.data(), chunk.size(), &got) == MA_SUCCESS) total += got;
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        bool failed = stream_failed(*reader.stream);
+        close_stream(*reader.stream);
+        net_cancel(g_net, reader.request->id);
+        if (failed || total == 0) {
+            std::cerr << "Cannot download " << url << "\n";
+            return 1;
+        }
+
+        rates[i] = total / elapsed / (1024 * 1024);
+        std::cout << counts[i] << (counts[i] == 1 ? " connection:  " : " connections: ") << total / 1024 << " KiB in "
+                  << elapsed << " s, " << rates[i] << " MiB/s\n";
+    }
+    std::cout << "gain: " << rates[1] / rates[0] << "x\n";
+    return 0;
+}
+
+// Times decoder init with miniaudio probing every backend against the
+// sniffed format, then decodes a local file start to finish through
+// miniaudio's stdio reader, the pread source and the mapped source, and
+// reports the CPU time and page faults each pass cost. "cold" drops the file
+// from the page cache before each pass.
+int run_decode_benchmark(const std::string &file, bool cold) {
+    static const char* SOURCES[] = {"stdio", "pread", "mmap"};
+    static const int INIT_ROUNDS = 50;
+    LocalReader probe;
+    std::atomic<ma_uint64> probe_hits{0}, probe_misses{0};
+    probe.hits = &probe_hits;
+    probe.misses = &probe_misses;
+    if (!local_open(probe, file, false)) {
+        std::cerr << "Cannot open " << file << "\n";
+        return 1;
+    }
+    unsigned char head[SNIFF_BYTES];
+    ma_encoding_format sniffed = sniff_encoding_format(head, local_peek(probe, head, sizeof(head)), file);
+    double init_ms[2] = {};
+    for (int sniff = 0; sniff < 2; sniff++) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < INIT_ROUNDS; i++) {
+            ma_decoder decoder;
+            probe.offset = 0;
+            ma_decoder_config config = ma_decoder_config_init(ma_format_f32, 0, 0);
+            if (init_decoder(local_read, local_seek, &probe, config, sniff ? sniffed : ma_encoding_format_unknown, &decoder) != MA_SUCCESS) {
+                std::cerr << "Cannot decode " << file << "\n";
+                local_close(probe);
+                return 1;
+            }
+            ma_decoder_uninit(&decoder);
+        }
+        init_ms[sniff] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / INIT_ROUNDS;
+    }
+    local_close(probe);
+    char line[160];
+    snprintf(line, sizeof(line), "init   probed %.3f ms, sniffed %.3f ms (%s)", init_ms[0], init_ms[1], ENCODING_FORMAT_NAMES[sniffed]);
+    std::cout << line << "\n";
+
+    std::vector<float> pcm(4096 * 8);
+    for (int source = 0; source < 3; source++) {
+        if (cold) {
+            int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            if (fd >= 0) close(fd);
+        }
+        struct rusage before, after;
+        getrusage(RUSAGE_THREAD, &before);
+        auto start = std::chrono::steady_clock::now();
+
+        ma_decoder decoder;
+        LocalReader reader;
+        std::atomic<ma_uint64> hits{0}, misses{0};
+        reader.hits = &hits;
+        reader.misses = &misses;
+        ma_decoder_config config = ma_decoder_config_init(ma_format_f32, 0, 0);
+        ma_result result;
+        if (source == 0) {
+            result = ma_decoder_init_file(file.c_str(), &config, &decoder);
+        } else if (local_open(reader, file, source == 2)) {
+            result = init_decoder(local_read, local_seek, &reader, config, sniffed, &decoder);
+            if (result != MA_SUCCESS) local_close(reader);
+        } else {
+            result = MA_ERROR;
+        }
+        if (result != MA_SUCCESS) {
+            std::cerr << "Cannot decode " << file << "\n";
+            return 1;
+        }
+        ma_uint64 frames = 0, got = 0;
+        ma_uint64 chunk = pcm.size() / std::max<ma_uint32>(1, decoder.outputChannels);
+        while (ma_decoder_read_pcm_frames(&decoder, pcm.data(), chunk, &got) == MA_SUCCESS && got > 0) frames += got;
+        ma_decoder_uninit(&decoder);
+        local_close(reader);
+
+        double wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        getrusage(RUSAGE_THREAD, &after);
+        auto ms = [](const timeval &a, const timeval &b) { return (b.tv_sec - a.tv_sec) * 1000.0 + (b.tv_usec - a.tv_usec) / 1000.0; };
+        snprintf(line, sizeof(line), "%-6s %7.1f ms cpu (%.1f user, %.1f sys)  %7.1f ms wall  %6ld minor  %4ld major faults  %llu frames",
+                 SOURCES[source], ms(before.ru_utime, after.ru_utime) + ms(before.ru_stime, after.ru_stime),
+                 ms(before.ru_utime, after.ru_utime), ms(before.ru_stime, after.ru_stime), wall,
+                 after.ru_minflt - before.ru_minflt, after.ru_majflt - before.ru_majflt, (unsigned long long)frames);
+        std::cout << line << "\n";
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
+    if (argc >= 3 && std::string(argv[1]) == "--bench-decode") {
+        return run_decode_benchmark(argv[2], argc >= 4 && std::string(argv[3]) == "cold");
+    }
+    if (argc >= 3 && std::string(argv[1]) == "--bench-download") {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        start_network(g_net);
+        int segments = argc >= 4 ? atoi(argv[3]) : 4;
+        int64_t size_hint = argc >= 5 ? atoll(argv[4]) : -1;
+        int rc = run_download_benchmark(argv[2], std::max(2, std::min(NET_MAX_SEGMENTS, segments)), size_hint);
+        stop_network(g_net);
+        curl_global_cleanup();
+        return rc;
+    }
+    if (argc >= 3 && std::string(argv[1]) == "--bench-power") {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        start_network(g_net);
+        int rc = run_power_benchmark(argv[2], argc >= 4 ? std::max(1, atoi(argv[3])) : 10);
+        stop_network(g_net);
+        curl_global_cleanup();
+        return rc;
+    }
+
     setlocale(LC_ALL, "");
+    load_thread_roles();
+    apply_thread_role(ROLE_UI);
     initscr();
     noecho();
     cbreak();
     keypad(stdscr, TRUE);
     curs_set(0);
+    g_ui_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     start_color();
 
     curl_global_init(CURL_GLOBAL_DEFAULT);
+    start_network(g_net);
     
     init_pair(COLOR_BG, COLOR_WHITE, COLOR_BLACK);
     init_pair(COLOR_HEADER, COLOR_CYAN, COLOR_BLACK);
@@ -444,45 +4311,125 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    std::vector<std::string> files;
+    // The list fills in while the scan or crawl runs; the UI never waits for it.
+    Library library;
+    std::vector<MusicEntry> added;
+    std::vector<std::string> removed;
+    RemoteCrawl crawl;
+    LocalScan scan;
+    auto scan_started = std::chrono::steady_clock::now();
     if (is_url) {
-        files = get_remote_music_files(path, username, password);
+        std::vector<CrawledDir> cached;
+        load_listing_cache(path, username, cached);
+        added = cached_music_files(cached);
+        library_apply(library, added, removed);
+        start_crawl(crawl, path, username, password, std::move(cached));
     } else {
-        files = get_local_music_files(path);
-    }
-    
-    std::sort(files.begin(), files.end(), [](const std::string &a, const std::string &b) {
-        std::string A = a, B = b;
-        std::transform(A.begin(), A.end(), A.begin(), ::tolower);
-        std::transform(B.begin(), B.end(), B.begin(), ::tolower);
-        return A < B;
-    });
-
-
-    if (files.empty()) {
-        endwin();
-        std::cerr << "No music files found in " << path << "\n";
-        curl_global_cleanup();
-        return 1;
+        start_local_scan(scan, path);
     }
+    double scan_seconds = 0;
 
     int highlight = 0, ch, start_idx = 0;
+    int playing = -1;
+    bool show_stats = false;
     PlaybackState state;
-    std::thread pb_thread;
+    init_audio_engine(state);
+    start_engine(state);
 
-    auto cleanup_thread = [&]() {
-        stop_playback(state);
-        if (pb_thread.joinable()) pb_thread.join();
+    std::string status;
+    int ui_profile = PROFILE_INTERACTIVE;
+
+    auto track_path = [&](int idx) {
+        if (!is_url) return path + "/" + library_path(library, idx);
+        return path + (path.back() == '/' ? "" : "/") + library_path(library, idx);
+    };
+
+    auto play_index = [&](int idx) {
+        playing = idx;
+        EngineCommand cmd;
+        cmd.type = CMD_PLAY;
+        cmd.path = track_path(idx);
+        cmd.remote = is_url;
+        cmd.size = library.tracks[idx].size;
+        cmd.username = username;
+        cmd.password = password;
+        if (send_command(state, std::move(cmd))) {
+            status = "Loading - " + url_decode(library_path(library, idx));
+        }
+    };
+
+    auto prefetch_index = [&](int idx) {
+        EngineCommand cmd;
+        cmd.type = CMD_PREFETCH;
+        cmd.path = track_path(idx);
+        cmd.remote = is_url;
+        cmd.size = library.tracks[idx].size;
+        cmd.username = username;
+        cmd.password = password;
+        send_command(state, std::move(cmd));
     };
 
-    halfdelay(1);
+    // Local libraries get the highlighted row's decoder ready once the cursor rests on it.
+    // Returns the milliseconds left until then, or -1 when there is nothing to wait for.
+    std::string warmed;
+    int dwell_index = -1;
+    auto dwell_since = std::chrono::steady_clock::now();
+    auto warm_highlight = [&](const PlaybackSnapshot &snap) -> int {
+        if (is_url || library.tracks.empty() || (snap.playing && highlight == playing)) return -1;
+        auto now = std::chrono::steady_clock::now();
+        if (highlight != dwell_index) {
+            dwell_index = highlight;
+            dwell_since = now;
+        }
+        if (now - dwell_since < WARM_DWELL) {
+            return (int)std::chrono::duration_cast<std::chrono::milliseconds>(dwell_since + WARM_DWELL - now).count() + 1;
+        }
+        std::string target = track_path(highlight);
+        if (target == warmed) return -1;
+        EngineCommand cmd;
+        cmd.type = CMD_WARM;
+        cmd.path = target;
+        if (send_command(state, std::move(cmd))) warmed = target;
+        return -1;
+    };
+
+    auto send_simple = [&](EngineCommandType type, int profile = 0) {
+        EngineCommand cmd;
+        cmd.type = type;
+        cmd.profile = profile;
+        send_command(state, std::move(cmd));
+    };
+
+    UiMeters meters;
+    auto last_key = std::chrono::steady_clock::now();
+    int warm_wait = -1;
+    nodelay(stdscr, TRUE);
 
     while (true) {
+        bool changed = is_url ? take_crawl_entries(crawl, added, removed) : take_scan_entries(scan, added, removed);
+        if (changed) {
+            std::string current = library.tracks.empty() ? "" : library_path(library, highlight);
+            std::string current_playing = playing >= 0 ? library_path(library, playing) : "";
+            library_apply(library, added, removed);
+            added.clear();
+            removed.clear();
+            int found = library_find(library, current);
+            highlight = found >= 0 ? found : std::max(0, std::min(highlight, (int)library.tracks.size() - 1));
+            if (playing >= 0) playing = library_find(library, current_playing);
+        }
+        bool scanning = is_url ? !crawl.done : !scan.done;
+        if (scanning) scan_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - scan_started).count();
+
         erase();
+        PlaybackSnapshot snap = playback_snapshot(state);
         int h, w;
         getmaxyx(stdscr, h, w);
 
-        draw_header(w, path);
+        char counter[96];
+        int dirs = is_url ? crawl.dirs_listed.load() : scan.dirs_scanned.load();
+        if (scanning) snprintf(counter, sizeof(counter), "%zu tracks, scanning (%d folders, %.1f s)", library.tracks.size(), dirs, scan_seconds);
+        else snprintf(counter, sizeof(counter), "%zu tracks in %d folders, scanned in %.1f s", library.tracks.size(), dirs, scan_seconds);
+        draw_header(w, path, counter);
         draw_separator(1, w);
 
         int list_height = h - 7;
@@ -490,9 +4437,9 @@ int main(int argc, char* argv[]) {
         if (highlight < start_idx) start_idx = highlight;
         else if (highlight >= start_idx + list_height) start_idx = highlight - list_height + 1;
 
-        for (int i = 0; i < list_height && start_idx + i < (int)files.size(); i++) {
+        for (int i = 0; !show_stats && i < list_height && start_idx + i < (int)library.tracks.size(); i++) {
             int idx = start_idx + i;
-            std::string display_name = url_decode(files[idx]); 
+            std::string display_name = url_decode(library_path(library, idx));
 
             if (idx == highlight) {
                 attron(COLOR_PAIR(COLOR_HIGHLIGHT) | A_BOLD);
@@ -500,7 +4447,7 @@ int main(int argc, char* argv[]) {
                 attron(COLOR_PAIR(COLOR_LIST));
             }
 
-            std::string prefix = (state.playing && display_name == state.current_file) ? "~ " : "  ";
+            std::string prefix = (snap.playing && idx == playing) ? "~ " : "  ";
             std::wstring wname = utf8_to_wstring(prefix + display_name);
             mvaddwstr(i + 2, 0, wname.c_str());
 
@@ -512,95 +4459,96 @@ int main(int argc, char* argv[]) {
             }
         }
 
+        if (!show_stats && library.tracks.empty()) {
+            attron(COLOR_PAIR(COLOR_LIST));
+            mvprintw(2, 2, scanning ? "Looking for music..." : "No music files found in %s", path.c_str());
+            attroff(COLOR_PAIR(COLOR_LIST));
+        }
+        if (show_stats) draw_stats(h, state, snap, meters);
+
         draw_separator(h - 5, w);
         draw_footer(h, w);
         draw_separator(h - 4, w);
-        draw_playback_bar(h, w, state);
+        draw_playback_bar(h, w, snap, status);
 
         wnoutrefresh(stdscr);
         doupdate();
 
+        sample_meters(meters);
+        // Only a playing track, a scan and the stats view redraw on a timer;
+        // otherwise the UI sleeps until a key or wake_ui().
+        int wait_ms = -1;
+        if ((snap.playing && !snap.paused) || scanning || show_stats) wait_ms = ui_profile == PROFILE_CONSERVATIVE ? 500 : 100;
+        if (warm_wait >= 0 && (wait_ms < 0 || warm_wait < wait_ms)) wait_ms = warm_wait;
+        struct pollfd pfds[2] = {{STDIN_FILENO, POLLIN, 0}, {g_ui_wake_fd, POLLIN, 0}};
+        if (poll(pfds, 2, wait_ms) > 0 && (pfds[1].revents & POLLIN)) {
+            eventfd_t count;
+            eventfd_read(g_ui_wake_fd, &count);
+        }
         ch = getch();
+        if (ch != ERR) {
+            last_key = std::chrono::steady_clock::now();
+            if (ui_profile == PROFILE_CONSERVATIVE) {
+                ui_profile = PROFILE_INTERACTIVE;
+                send_simple(CMD_SET_PROFILE, ui_profile);
+            }
+        } else if (ui_profile == PROFILE_INTERACTIVE && snap.playing &&
+                   std::chrono::steady_clock::now() - last_key > IDLE_TO_CONSERVATIVE) {
+            ui_profile = PROFILE_CONSERVATIVE;
+            send_simple(CMD_SET_PROFILE, ui_profile);
+        }
         if (ch == 'q' || ch == 'Q') break;
         else if (ch == KEY_UP && highlight > 0) highlight--;
-        else if (ch == KEY_DOWN && highlight < (int)files.size() - 1) highlight++;
-        else if (ch == 10) {
-            if (state.playing && files[highlight] == state.current_file) {
-                toggle_pause(state);
+        else if (ch == KEY_DOWN && highlight < (int)library.tracks.size() - 1) highlight++;
+        else if (ch == 10 && !library.tracks.empty()) {
+            if (snap.playing && highlight == playing) {
+                send_simple(CMD_TOGGLE_PAUSE);
             } else {
-                cleanup_thread();
-
-                std::string fp;
-                if (is_url) {
-                    if (path.back() != '/') fp = path + "/";
-                    else fp = path;
-                    fp += files[highlight];
-                    if (!username.empty()) {
-                        start_playback(state, fp, true, username, password);
-                    } else {
-                        start_playback(state, fp, true);
-                    }
-                } else {
-                    fp = path + "/" + files[highlight];
-                    start_playback(state, fp, false);
-                }
-
-                pb_thread = std::thread([&]() {
-                    while (state.playing && !state.stop_requested) {
-                        ma_uint64 cur = state.current_frame.load();
-                        ma_uint64 len = state.total_frames.load();
-                        if (len > 0 && cur >= len) {
-                            state.track_finished = true;
-                            return;
-                        }
-                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                    }
-                });
+                play_index(highlight);
             }
         } else if (ch == ' ') {
-            if (state.playing) {
-                toggle_pause(state);
+            if (snap.playing) {
+                send_simple(CMD_TOGGLE_PAUSE);
             }
+        } else if (ch == 's' || ch == 'S') {
+            show_stats = !show_stats;
         }
 
-        if (state.track_finished) {
-            state.track_finished = false;
-            cleanup_thread(); 
-
-            highlight = (highlight + 1) % files.size();
-
-            std::string next_fp;
-            if (is_url) {
-                next_fp = path + (path.back() == '/' ? "" : "/") + files[highlight];
-                if (!username.empty()) {
-                    start_playback(state, next_fp, true, username, password);
-                } else {
-                    start_playback(state, next_fp, true);
-                }
-            } else {
-                next_fp = path + "/" + files[highlight];
-                start_playback(state, next_fp, false);
+        EngineEvent ev;
+        while (state.events.pop(ev)) {
+            if (ev.generation != state.load_generation) continue;
+            if (ev.type == EVT_STARTED) {
+                status.clear();
+                int upcoming = is_url ? 1 : LOCAL_PREFETCH_TRACKS;
+                for (int i = 1; i <= upcoming && i < (int)library.tracks.size(); i++) prefetch_index((highlight + i) % library.tracks.size());
+            } else if (ev.type == EVT_FAILED) {
+                status = "Could not play " + url_decode(ev.path.substr(ev.path.find_last_of('/') + 1));
+            } else if (ev.type == EVT_TRACK_FINISHED && !library.tracks.empty()) {
+                highlight = (highlight + 1) % library.tracks.size();
+                play_index(highlight);
             }
-
-            pb_thread = std::thread([&]() {
-                while (state.playing && !state.stop_requested) {
-                    ma_uint64 cur = state.current_frame.load();
-                    ma_uint64 len = state.total_frames.load();
-                    if (len > 0 && cur >= len) {
-                        state.track_finished = true;
-                        return;
-                    }
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                }
-            });
         }
 
+        warm_wait = warm_highlight(snap);
+        // Caps redraws when wakes arrive in bursts, as during a scan.
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
 
 
-    cleanup_thread();
+    stop_crawl(crawl);
+    stop_local_scan(scan);
+    stop_engine(state);
+    uninit_audio_engine(state);
     endwin();
+    if (g_ui_wake_fd >= 0) close(g_ui_wake_fd);
+    g_ui_wake_fd = -1;
+    stop_network(g_net);
     curl_global_cleanup();
+#ifdef COOKIE_RT_DEBUG
+    std::cerr << "Audio callback violations: " << g_rt_violations[RT_ALLOC] << " alloc, "
+              << g_rt_violations[RT_LOCK] << " lock, " << g_rt_violations[RT_SYSCALL] << " syscall\n";
+    std::cerr << "Audio arena: " << (g_audio_arena.locked ? "locked" : "not locked") << ", "
+              << g_audio_arena.fallback_allocs << " malloc fallbacks\n";
+#endif
     return 0;
 }